@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && !defined(PNMIO_NO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_FAST_POLL)
+#define HAVE_URING
+#endif
+
+#include "pnmio.h"
+
+// Size and number of the read buffers:
+#define BUFSIZE		(1024 * 1024)
+#define NBUFS		4
+
+struct pnmio
+{
+	struct pnmreader *pr;
+	int fd;
+	char *bufs;
+
+	// Reads are numbered in stream order, read n going into buffer n %
+	// NBUFS. The number of reads started, of reads completed by the
+	// read-ahead thread, and of buffers fed to the reader:
+	uint64_t submitted;
+	uint64_t filled;
+	uint64_t fed;
+
+	// The result of the read into each buffer, and whether it is done:
+	ssize_t len[NBUFS];
+	bool done[NBUFS];
+
+	// Read-ahead thread, used without io_uring:
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+};
+
+static inline char *
+buffer (struct pnmio *io, uint64_t n)
+{
+	return io->bufs + (n % NBUFS) * BUFSIZE;
+}
+
+#if defined(HAVE_URING)
+
+// User data of cancel requests. Reads carry the index of their buffer:
+#define CANCEL_TAG	UINT64_MAX
+
+struct uring
+{
+	int fd;
+
+	// The mapped rings, where the completion ring can share the mapping
+	// of the submission ring:
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Requests queued but not yet submitted, and not yet completed:
+	unsigned int pending;
+	unsigned int inflight;
+};
+
+static void
+uring_close (struct uring *u)
+{
+	if (u->sqes != MAP_FAILED) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_size);
+	}
+	if (u->sq_ring != MAP_FAILED) {
+		munmap(u->sq_ring, u->sq_size);
+	}
+	close(u->fd);
+}
+
+static bool
+uring_setup (struct uring *u)
+{
+	struct io_uring_params p;
+
+	// Room for a read into every buffer, and for cancelling them all:
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = syscall(__NR_io_uring_setup, NBUFS * 2, &p)) < 0) {
+		return false;
+	}
+	u->sq_ring = MAP_FAILED;
+	u->cq_ring = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+
+	// Reads from pipes must wait for data by polling rather than in a
+	// blocked kernel thread, so that they can be cancelled:
+	if ((p.features & IORING_FEAT_FAST_POLL) == 0) {
+		uring_close(u);
+		return false;
+	}
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->sq_size < u->cq_size) {
+			u->sq_size = u->cq_size;
+		}
+		u->cq_size = u->sq_size;
+	}
+	if ((u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		uring_close(u);
+		return false;
+	}
+	u->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP)
+		? u->sq_ring
+		: mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_CQ_RING);
+
+	if (u->cq_ring == MAP_FAILED) {
+		uring_close(u);
+		return false;
+	}
+	if ((u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		uring_close(u);
+		return false;
+	}
+	u->sq_tail  = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask  = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head  = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail  = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask  = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+	u->pending  = 0;
+	u->inflight = 0;
+	return true;
+}
+
+static void
+uring_queue (struct uring *u, int fd, uint8_t opcode, uint64_t user_data, uint64_t addr, unsigned int len, uint64_t off)
+{
+	// Only this thread writes the tail of the submission ring. The kernel
+	// must see the entry before the new tail:
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	u->sq_array[idx] = idx;
+
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->pending++;
+	u->inflight++;
+}
+
+static bool
+uring_enter (struct uring *u, unsigned int min_complete)
+{
+	// Submit the queued requests, and wait for completions if asked to:
+	for (;;) {
+		long ret = syscall(__NR_io_uring_enter, u->fd, u->pending, min_complete, (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+		if (ret >= 0) {
+			u->pending -= ret;
+			return true;
+		}
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+static bool
+uring_reap (struct uring *u, struct pnmio *io)
+{
+	// Wait for at least one completion, and store the results of the
+	// reads among them:
+	unsigned int head = *u->cq_head;
+	unsigned int tail;
+
+	while ((tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) == head) {
+		if (uring_enter(u, 1) == false) {
+			return false;
+		}
+	}
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+		if (cqe->user_data != CANCEL_TAG) {
+			io->len[cqe->user_data] = cqe->res;
+			io->done[cqe->user_data] = true;
+		}
+		u->inflight--;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+uring_drain (struct uring *u, struct pnmio *io)
+{
+	// Cancel the reads in flight, such as those of a pipe that has no
+	// more data, and wait for them. Their buffers are free afterwards:
+	for (uint64_t n = io->fed; n < io->submitted; n++) {
+		if (io->done[n % NBUFS] == false) {
+			uring_queue(u, -1, IORING_OP_ASYNC_CANCEL, CANCEL_TAG, n % NBUFS, 0, 0);
+		}
+	}
+	while (u->inflight > 0) {
+		if (uring_reap(u, io) == false) {
+			return false;
+		}
+	}
+	memset(io->done, 0, sizeof(io->done));
+	io->submitted = io->fed;
+	return true;
+}
+
+static void
+uring_read (struct uring *u, struct pnmio *io, uint64_t *offset, uint64_t *offsets)
+{
+	// Read into the next buffer. A file is read at increasing offsets,
+	// a stream at its current position:
+	size_t n = io->submitted++ % NBUFS;
+
+	offsets[n] = *offset;
+	uring_queue(u, io->fd, IORING_OP_READ, n, (uintptr_t)buffer(io, n), BUFSIZE, *offset);
+	if (*offset != UINT64_MAX) {
+		*offset += BUFSIZE;
+	}
+}
+
+static enum pnmreader_result
+feed_uring (struct pnmio *io, struct uring *u)
+{
+	// A file is read ahead into all free buffers at once. A stream must
+	// be read in order, so only one read is in flight at a time, but it
+	// runs while the buffer before it is decoded:
+	off_t start = lseek(io->fd, 0, SEEK_CUR);
+	uint64_t offset = (start >= 0) ? (uint64_t)start : UINT64_MAX;
+	uint64_t offsets[NBUFS];
+	const bool seekable = (start >= 0);
+	enum pnmreader_result res = PNMREADER_FEED_ME;
+
+	for (;;) {
+		while (io->submitted < io->fed + (seekable ? NBUFS : 1)) {
+			uring_read(u, io, &offset, offsets);
+		}
+		if (uring_enter(u, 0) == false) {
+			break;
+		}
+		size_t n = io->fed % NBUFS;
+		bool ok = true;
+
+		while (ok && io->done[n] == false) {
+			ok = uring_reap(u, io);
+		}
+		// Stop at the end of the input or on a read error:
+		if (ok == false || io->len[n] <= 0) {
+			break;
+		}
+		io->done[n] = false;
+
+		if (!seekable) {
+			uring_read(u, io, &offset, offsets);
+			if (uring_enter(u, 0) == false) {
+				break;
+			}
+		}
+		res = pnmreader_feed(io->pr, buffer(io, n), io->len[n]);
+		io->fed++;
+
+		if (res != PNMREADER_FEED_ME) {
+			break;
+		}
+		// A short read of a file is normally its end, but then the reads
+		// after it would leave a gap. Read on from where it ended:
+		if (seekable && io->len[n] < BUFSIZE) {
+			if (uring_drain(u, io) == false) {
+				break;
+			}
+			offset = offsets[n] + io->len[n];
+		}
+	}
+	uring_drain(u, io);
+	return res;
+}
+
+#endif	// HAVE_URING
+
+static void *
+read_ahead (void *arg)
+{
+	// Fill the buffers in order, up to the one being decoded. Only the
+	// read itself can be cancelled, since it may block on a pipe that
+	// never gets more data:
+	struct pnmio *io = arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (uint64_t seq = 0;; seq++) {
+		size_t n = seq % NBUFS;
+		ssize_t len;
+
+		pthread_mutex_lock(&io->lock);
+		while (io->stop == false && seq - io->fed >= NBUFS) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		}
+		if (io->stop) {
+			pthread_mutex_unlock(&io->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&io->lock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		while ((len = read(io->fd, buffer(io, n), BUFSIZE)) < 0 && errno == EINTR) {
+			continue;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&io->lock);
+		io->len[n] = len;
+		io->filled = seq + 1;
+		pthread_cond_signal(&io->cond);
+		pthread_mutex_unlock(&io->lock);
+
+		if (len <= 0) {
+			return NULL;
+		}
+	}
+}
+
+static enum pnmreader_result
+feed_blocking (struct pnmio *io)
+{
+	// Read and decode in turn:
+	enum pnmreader_result res = PNMREADER_FEED_ME;
+	ssize_t len;
+
+	while (res == PNMREADER_FEED_ME) {
+		if ((len = read(io->fd, io->bufs, BUFSIZE)) < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			break;
+		}
+		res = pnmreader_feed(io->pr, io->bufs, len);
+	}
+	return res;
+}
+
+static enum pnmreader_result
+feed_threaded (struct pnmio *io)
+{
+	enum pnmreader_result res = PNMREADER_FEED_ME;
+	pthread_t thread;
+
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->cond, NULL);
+	io->stop = false;
+
+	if (pthread_create(&thread, NULL, read_ahead, io) != 0) {
+		res = feed_blocking(io);
+		goto out;
+	}
+	for (;;) {
+		size_t n = io->fed % NBUFS;
+		ssize_t len;
+
+		pthread_mutex_lock(&io->lock);
+		while (io->filled == io->fed) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		}
+		len = io->len[n];
+		pthread_mutex_unlock(&io->lock);
+
+		if (len <= 0) {
+			break;
+		}
+		res = pnmreader_feed(io->pr, buffer(io, n), len);
+
+		pthread_mutex_lock(&io->lock);
+		io->fed++;
+		pthread_cond_signal(&io->cond);
+		pthread_mutex_unlock(&io->lock);
+
+		if (res != PNMREADER_FEED_ME) {
+			break;
+		}
+	}
+	// Stop the thread, also if it waits for more data:
+	pthread_mutex_lock(&io->lock);
+	io->stop = true;
+	pthread_cond_signal(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+
+out:	pthread_cond_destroy(&io->cond);
+	pthread_mutex_destroy(&io->lock);
+	return res;
+}
+
+enum pnmreader_result
+pnmio_feed_fd (struct pnmreader *pr, int fd)
+{
+	struct pnmreader_map map;
+	enum pnmreader_result res;
+	struct pnmio io;
+
+	if (pr == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	// Decode binary files in place if possible, else stream the input:
+	if (pnmreader_map_fd(fd, &map) == PNMREADER_SUCCESS) {
+		res = pnmreader_feed(pr, map.data, map.size);
+		pnmreader_unmap(&map);
+		return res;
+	}
+	if ((io.bufs = malloc(NBUFS * BUFSIZE)) == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	io.pr = pr;
+	io.fd = fd;
+	io.submitted = 0;
+	io.filled = 0;
+	io.fed = 0;
+	memset(io.done, 0, sizeof(io.done));
+
+#if defined(HAVE_URING)
+	struct uring u;
+
+	if (uring_setup(&u)) {
+		res = feed_uring(&io, &u);
+
+		// If a read could not be cancelled, the kernel may still write
+		// into its buffer, so leave the buffers allocated:
+		if (u.inflight == 0) {
+			free(io.bufs);
+		}
+		uring_close(&u);
+		return res;
+	}
+#endif
+	res = feed_threaded(&io);
+	free(io.bufs);
+	return res;
+}
@@ -0,0 +1,18 @@
+#ifndef PNMIO_H
+#define PNMIO_H
+
+#include "../pnmreader/pnmreader.h"
+
+// Read the data from a file descriptor and feed it to the reader, until the
+// reader returns anything other than PNMREADER_FEED_ME or the input ends.
+// Binary files are mapped into memory and decoded in place. Other input is
+// read into a few buffers, with reads in flight while the reader decodes
+// the buffer before them. On Linux, the reads go through io_uring; without
+// it, a thread reads ahead with read(). Returns the last result of the
+// reader, PNMREADER_FEED_ME if the input ended early or could not be read,
+// or PNMREADER_ABORTED if the buffers could not be allocated. Data after the
+// end of the image is read but not used, so the file offset is unspecified
+// afterwards.
+enum pnmreader_result pnmio_feed_fd (struct pnmreader *, int fd);
+
+#endif
@@ -1,10 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(PNMREADER_STATS)
+#include <time.h>
+#endif
 
 #include "pnmreader.h"
 
+// Instrumentation, see pnmreader_get_stats(). Without PNMREADER_STATS, the
+// counting code is left out altogether and user callbacks are plain calls:
+#if defined(PNMREADER_STATS)
+#define STATS(...)	__VA_ARGS__
+#define USER_CALL(pr, counter, call) \
+	((pr)->stats.counter++, (pr)->call_start = stats_clock(), stats_leave((pr), (call)))
+#else
+#define STATS(...)
+#define USER_CALL(pr, counter, call)	(call)
+#endif
+
 enum state {
+	STATE_SEPARATOR,
 	STATE_FORMAT,
+	STATE_PAM_HEADER,
 	STATE_WIDTH,
 	STATE_HEIGHT,
 	STATE_MAXVAL,
@@ -14,14 +46,25 @@ enum state {
 	STATE_BINDATA_PBM,
 	STATE_BINDATA_PGM,
 	STATE_BINDATA_PPM,
+	STATE_BINDATA_PAM,
 	STATE_FINISHED
 };
 
+// Internal result of the decoders when the batch of rows requested with
+// pnmreader_next_rows() is full. Never returned to the caller:
+#define PNMREADER_PAUSED	((enum pnmreader_result)(PNMREADER_ABORTED + 1))
+
+// Upper limits for the PAM header. The depth limit keeps the size of a row
+// within 64 bits:
+#define PAM_KEYWORD_MAX		8
+#define PAM_TUPLTYPE_MAX	255
+#define PAM_DEPTH_MAX		65535
+
 enum charclass {
+	CHAR_INVALID,
 	CHAR_NUMERIC,
 	CHAR_COMMENT,
-	CHAR_WHITESPACE,
-	CHAR_INVALID
+	CHAR_WHITESPACE
 };
 
 struct pnmreader
@@ -30,18 +73,78 @@ struct pnmreader
 	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata);
 	bool (*got_maxval) (unsigned int maxval, void *userdata);
 	bool (*got_pixel) (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata);
+	bool (*got_row) (unsigned int row, const void *samples, void *userdata);
 	void *userdata;
 
+	// Row assembly buffer, only used when got_row is set:
+	unsigned char *rowbuf;
+	size_t rowbuf_size;
+	unsigned int channels;
+
+	// Optional destination buffer for the rows, used instead of rowbuf:
+	unsigned char *dest;
+	size_t dest_stride;
+
+	// If set, rows are assembled in rowbuf and converted into the
+	// destination buffer in the given layout, scaling the samples through
+	// the lookup table if rescale is set:
+	bool convert;
+	unsigned int layout;
+	bool rescale;
+	uint16_t *scale;
+	size_t scale_size;
+
+	// Pull mode, see pnmreader_next_rows(): complete rows are copied from
+	// the row buffer into the caller's buffer, until it holds the number
+	// of rows asked for:
+	bool pulling;
+	unsigned char *pull;
+	size_t pull_stride;
+	unsigned int pull_rows;
+	unsigned int pull_max;
+
+	// Region of interest as set by the user, and as clipped to the image:
+	unsigned int roi_x;
+	unsigned int roi_y;
+	unsigned int roi_w;
+	unsigned int roi_h;
+	unsigned int x0;
+	unsigned int x1;
+	unsigned int y0;
+	unsigned int y1;
+
 	enum charclass charclass;
 	unsigned char *cur;
 	unsigned char *buf;
-	size_t bufsize;
+	unsigned char *end;
 	unsigned int asciinum;
 
 	enum state state;
 	int substate;
 
-	unsigned int seek;
+	// Bulk decoder for the raster, specialized for the image and the
+	// callbacks when the header is complete:
+	enum pnmreader_result (*bulk) (struct pnmreader *);
+
+	// Multi-image mode, and the number of bytes used from the last buffer:
+	bool multi;
+	size_t consumed;
+
+	// Stream offset of the data being fed, counted from the first byte fed
+	// to the reader, the offset of the binary raster, and the number of
+	// bytes to skip before decoding resumes:
+	uint64_t streampos;
+	uint64_t raster;
+	uint64_t seek;
+
+	// The PAM keyword being read and the tuple type, and the index of the
+	// next sample of a tuple in the bytewise raster state:
+	char keyword[PAM_KEYWORD_MAX + 1];
+	unsigned int keylen;
+	char tupltype[PAM_TUPLTYPE_MAX + 1];
+	unsigned int tupllen;
+	unsigned int sample;
+
 	unsigned int width;
 	unsigned int height;
 	unsigned int maxval;
@@ -51,8 +154,34 @@ struct pnmreader
 	unsigned int col;
 	unsigned int row;
 	enum pnm_format format;
+
+#if defined(PNMREADER_STATS)
+	// Counters, with the total time spent in the decoder kept in
+	// ns_decoder until reported, and the start time of a user callback:
+	struct pnmreader_stats stats;
+	uint64_t call_start;
+#endif
 };
 
+#if defined(PNMREADER_STATS)
+static inline uint64_t
+stats_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline bool
+stats_leave (struct pnmreader *const pr, bool ret)
+{
+	// Called right after a user callback returned:
+	pr->stats.ns_callbacks += stats_clock() - pr->call_start;
+	return ret;
+}
+#endif
+
 static inline bool
 increment_cur (struct pnmreader *const pr)
 {
@@ -61,10 +190,48 @@ increment_cur (struct pnmreader *const pr)
 	// Returns false if this lands us past the end of the buffer.
 
 	pr->cur++;
-	return (pr->cur < (pr->buf + pr->bufsize));
+	return (pr->cur < pr->end);
 }
 
-static void
+// Character classes for plain mode (index 0), where '0' through '9' are
+// numeric, and for plain bitmap mode (index 1), where only '0' and '1' are.
+// According to `man pbm`, only these constitute whitespace. Any character not
+// listed here is invalid:
+static const unsigned char charclass_table[2][256] =
+{
+	{
+		[' ']  = CHAR_WHITESPACE,
+		['\t'] = CHAR_WHITESPACE,
+		['\n'] = CHAR_WHITESPACE,
+		['\r'] = CHAR_WHITESPACE,
+		['#']  = CHAR_COMMENT,
+		['0']  = CHAR_NUMERIC,
+		['1']  = CHAR_NUMERIC,
+		['2']  = CHAR_NUMERIC,
+		['3']  = CHAR_NUMERIC,
+		['4']  = CHAR_NUMERIC,
+		['5']  = CHAR_NUMERIC,
+		['6']  = CHAR_NUMERIC,
+		['7']  = CHAR_NUMERIC,
+		['8']  = CHAR_NUMERIC,
+		['9']  = CHAR_NUMERIC,
+	},
+	{
+		[' ']  = CHAR_WHITESPACE,
+		['\t'] = CHAR_WHITESPACE,
+		['\n'] = CHAR_WHITESPACE,
+		['\r'] = CHAR_WHITESPACE,
+		['#']  = CHAR_COMMENT,
+		['0']  = CHAR_NUMERIC,
+		['1']  = CHAR_NUMERIC,
+	}
+};
+
+static const unsigned int pow10_table[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+static inline void
 classify_char (struct pnmreader *const pr, bool is_binary)
 {
 	// If we're inside a comment, the only escape is end-of-line:
@@ -74,40 +241,137 @@ classify_char (struct pnmreader *const pr, bool is_binary)
 		}
 		return;
 	}
-	// According to `man pbm`, only these constitute whitespace:
-	if (*pr->cur == ' ' || *pr->cur == '\t' || *pr->cur == '\n' || *pr->cur == '\r') {
-		pr->charclass = CHAR_WHITESPACE;
-		return;
+	pr->charclass = charclass_table[is_binary][*pr->cur];
+}
+
+static const unsigned char *
+find_eol (const unsigned char *p, const unsigned char *end)
+{
+	// Find the end of a comment, 16 bytes at a time:
+#if defined(__SSE2__)
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
 	}
-	// In binary mode, only acknowledge '0' and '1':
-	if (is_binary && (*pr->cur == '0' || *pr->cur == '1')) {
-		pr->charclass = CHAR_NUMERIC;
-		return;
+#endif
+	for (; p < end; p++) {
+		if (*p == '\n' || *p == '\r') {
+			break;
+		}
 	}
-	// In full mode, allow '0' through '9':
-	if (!is_binary && (*pr->cur >= '0' && *pr->cur <= '9')) {
-		pr->charclass = CHAR_NUMERIC;
-		return;
+	return p;
+}
+
+static const unsigned char *
+skip_whitespace (const unsigned char *p, const unsigned char *end)
+{
+	// Most separators are only a character or two long, so check the
+	// first few bytes before bothering with vector loads:
+	for (int i = 0; i < 4; i++, p++) {
+		if (p == end || charclass_table[0][*p] != CHAR_WHITESPACE) {
+			return p;
+		}
 	}
-	if (*pr->cur == '#') {
-		pr->charclass = CHAR_COMMENT;
-		return;
+#if defined(__SSE2__)
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i ws = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+		unsigned int mask = _mm_movemask_epi8(ws);
+		if (mask != 0xFFFF) {
+			return p + __builtin_ctz(~mask);
+		}
+	}
+#endif
+	while (p < end && charclass_table[0][*p] == CHAR_WHITESPACE) {
+		p++;
+	}
+	return p;
+}
+
+static inline uint64_t
+load_le64 (const unsigned char *p)
+{
+	// Load eight bytes of text with the first character in the least
+	// significant byte:
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+#else
+	uint64_t v = 0;
+
+	for (int i = 7; i >= 0; i--) {
+		v = (v << 8) | p[i];
 	}
-	pr->charclass = CHAR_INVALID;
+	return v;
+#endif
+}
+
+static inline unsigned int
+count_digits (uint64_t v)
+{
+	// Count the leading decimal digits in eight bytes of text. The high
+	// bit of a byte is set in at least one of the terms if it's not a digit.
+	// Carries and borrows only originate from non-digit bytes, so they
+	// cannot affect the digits that precede them:
+	uint64_t nondigit = ((v + 0x4646464646464646) | (v - 0x3030303030303030)) & 0x8080808080808080;
+
+	return (nondigit == 0) ? 8 : __builtin_ctzll(nondigit) / 8;
+}
+
+static inline unsigned int
+parse_digits (uint64_t v, unsigned int ndigits)
+{
+	// Parse up to eight digits at once: shift them into the most significant
+	// bytes, so that the vacated bytes act as leading zeros, and combine
+	// them pairwise into a single number:
+	v = (v << (8 * (8 - ndigits))) & 0x0F0F0F0F0F0F0F0F;
+	v = (v * 10) + (v >> 8);
+	v = (((v & 0x000000FF000000FF) * (100 + (1000000ULL << 32)))
+	   + (((v >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+
+	return (unsigned int)v;
 }
 
 static enum pnmreader_result
 skip_until_numeric (struct pnmreader *const pr, bool is_binary)
 {
+	const unsigned char *end = pr->end;
+
 	for (;;) {
-		classify_char(pr, is_binary);
+		// Skip the rest of a comment. The end-of-line character that
+		// terminates it is whitespace:
+		if (pr->charclass == CHAR_COMMENT) {
+			if ((pr->cur = (unsigned char *)find_eol(pr->cur, end)) == end) {
+				return PNMREADER_FEED_ME;
+			}
+			pr->charclass = CHAR_WHITESPACE;
+		}
+		if ((pr->cur = (unsigned char *)skip_whitespace(pr->cur, end)) == end) {
+			return PNMREADER_FEED_ME;
+		}
+		pr->charclass = charclass_table[is_binary][*pr->cur];
 		if (pr->charclass == CHAR_NUMERIC) {
 			return PNMREADER_SUCCESS;
 		}
 		if (pr->charclass == CHAR_INVALID) {
 			return PNMREADER_INVALID_CHAR;
 		}
-		// Char class must be whitespace or comment:
+		// Char class must be comment:
 		if (!increment_cur(pr)) {
 			return PNMREADER_FEED_ME;
 		}
@@ -130,7 +394,27 @@ skip_single_whitespace (struct pnmreader *const pr)
 static enum pnmreader_result
 read_ascii_number (struct pnmreader *const pr, bool is_binary)
 {
+	// Numbers that do not fit in an unsigned int saturate at UINT_MAX,
+	// which is more than any maxval, and which no dimension may be:
 	for (;;) {
+		// Consume runs of up to eight digits at once:
+		if (!is_binary && pr->end - pr->cur >= 8) {
+			uint64_t v = load_le64(pr->cur);
+			unsigned int ndigits;
+
+			if ((ndigits = count_digits(v)) > 0) {
+				uint64_t n = (uint64_t)pr->asciinum * pow10_table[ndigits] + parse_digits(v, ndigits);
+
+				pr->asciinum = (n < UINT_MAX) ? n : UINT_MAX;
+				pr->cur += ndigits;
+				if (ndigits == 8) {
+					if (pr->cur == pr->end) {
+						return PNMREADER_FEED_ME;
+					}
+					continue;
+				}
+			}
+		}
 		classify_char(pr, is_binary);
 		if (pr->charclass == CHAR_WHITESPACE) {
 			return PNMREADER_SUCCESS;
@@ -148,8 +432,9 @@ read_ascii_number (struct pnmreader *const pr, bool is_binary)
 					? PNMREADER_SUCCESS
 					: PNMREADER_FEED_ME;
 			}
-			pr->asciinum *= 10;
-			pr->asciinum += (*pr->cur - '0');
+			uint64_t n = (uint64_t)pr->asciinum * 10 + (*pr->cur - '0');
+
+			pr->asciinum = (n < UINT_MAX) ? n : UINT_MAX;
 		}
 		if (!increment_cur(pr)) {
 			return PNMREADER_FEED_ME;
@@ -157,13 +442,31 @@ read_ascii_number (struct pnmreader *const pr, bool is_binary)
 	}
 }
 
+static enum pnmreader_result
+state_separator (struct pnmreader *const pr)
+{
+	// Between images, skip whitespace and comments. Anything else is
+	// passed to state_format, which checks the signature:
+	if (skip_until_numeric(pr, false) == PNMREADER_FEED_ME) {
+		// In multi-image mode, running out of data here means that
+		// all images so far have been read completely:
+		return (pr->multi)
+			? PNMREADER_FINISHED
+			: PNMREADER_FEED_ME;
+	}
+	pr->charclass = CHAR_WHITESPACE;
+	pr->state = STATE_FORMAT;
+	pr->substate = 0;
+	return PNMREADER_SUCCESS;
+}
+
 static enum pnmreader_result
 state_format (struct pnmreader *const pr)
 {
 	// Signature consists of three bytes:
 	// Whitespace is fairly unambiguous:
 	// 0: the letter 'P';
-	// 1: a number '1'..'6';
+	// 1: a number '1'..'7';
 	// 2: a separator (whitespace or comment char).
 
 	switch (pr->substate)
@@ -183,6 +486,7 @@ state_format (struct pnmreader *const pr)
 				case '4': pr->format = FORMAT_PBM_BIN; break;
 				case '5': pr->format = FORMAT_PGM_BIN; break;
 				case '6': pr->format = FORMAT_PPM_BIN; break;
+				case '7': pr->format = FORMAT_PAM; break;
 				default : return PNMREADER_NO_SIGNATURE;
 			}
 			pr->substate = 2;
@@ -203,10 +507,21 @@ state_format (struct pnmreader *const pr)
 		case 3:	break;
 	}
 	if (pr->got_format != NULL) {
-		if (pr->got_format(pr->format, pr->userdata) == false) {
+		if (USER_CALL(pr, header_callbacks, pr->got_format(pr->format, pr->userdata)) == false) {
 			return PNMREADER_ABORTED;
 		}
 	}
+	// The number of samples per pixel follows from the PNM format. PAM
+	// has it in the header, along with all other fields:
+	if (pr->format == FORMAT_PAM) {
+		pr->channels = 0;
+		pr->tupllen = 0;
+		pr->tupltype[0] = '\0';
+		pr->state = STATE_PAM_HEADER;
+		pr->substate = 0;
+		return PNMREADER_SUCCESS;
+	}
+	pr->channels = (pr->format == FORMAT_PPM_ASC || pr->format == FORMAT_PPM_BIN) ? 3 : 1;
 	pr->state = STATE_WIDTH;
 	pr->substate = 0;
 	return PNMREADER_SUCCESS;
@@ -230,7 +545,7 @@ state_width (struct pnmreader *const pr)
 			}
 			pr->width = pr->asciinum;
 	}
-	if (pr->width == 0) {
+	if (pr->width == 0 || pr->width == UINT_MAX) {
 		return PNMREADER_UNSUPPORTED;
 	}
 	// pr->cur is the first non-numeric character after the width;
@@ -258,11 +573,11 @@ state_height (struct pnmreader *const pr)
 			}
 			pr->height = pr->asciinum;
 	}
-	if (pr->height == 0) {
+	if (pr->height == 0 || pr->height == UINT_MAX) {
 		return PNMREADER_UNSUPPORTED;
 	}
 	if (pr->got_geometry != NULL) {
-		if (pr->got_geometry(pr->width, pr->height, pr->userdata) == false) {
+		if (USER_CALL(pr, header_callbacks, pr->got_geometry(pr->width, pr->height, pr->userdata)) == false) {
 			return PNMREADER_ABORTED;
 		}
 	}
@@ -271,41 +586,146 @@ state_height (struct pnmreader *const pr)
 	return PNMREADER_SUCCESS;
 }
 
-static enum pnmreader_result
-state_maxval (struct pnmreader *const pr)
+static inline bool
+wants_rows (struct pnmreader *const pr)
 {
-	enum pnmreader_result res;
+	// Whether rows must be assembled:
+	return pr->got_row != NULL || pr->dest != NULL || pr->pulling;
+}
 
-	// The bitmap formats do not have an explicit maxval in the file,
-	// which would be redundant, so just set it here and skip the read:
-	if (pr->format == FORMAT_PBM_ASC || pr->format == FORMAT_PBM_BIN) {
-		pr->maxval = 1;
-		pr->substate = 2;
+static bool
+alloc_rowbuf (struct pnmreader *const pr)
+{
+	// Size of the part of a row in the region of interest, as passed to
+	// the got_row callback:
+	size_t samplesize = (pr->maxval > 255) ? 2 : 1;
+	size_t size;
+
+	if (pr->x1 - pr->x0 > SIZE_MAX / pr->channels / samplesize) {
+		return false;
 	}
-	switch (pr->substate)
-	{
-		case 0:	if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
-				return res;
-			}
-			pr->asciinum = 0;
-			pr->substate = 1;
+	size = (size_t)(pr->x1 - pr->x0) * pr->channels * samplesize;
 
-		case 1:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
-				return res;
-			}
-			pr->maxval = pr->asciinum;
-			pr->substate = 2;
+	// Pulled rows must fit the caller's stride:
+	if (pr->pulling && size > pr->pull_stride) {
+		return false;
+	}
 
-		case 2:	break;
+	// Rows are assembled in the destination buffer if there is one. It
+	// must be aligned for 16-bit samples:
+	if (pr->dest != NULL && pr->convert == false) {
+		if (samplesize == 2 && ((uintptr_t)pr->dest % 2 || pr->dest_stride % 2)) {
+			return false;
+		}
+		return (size <= pr->dest_stride);
+	}
+	// Rows are converted from the row buffer into the destination buffer:
+	if (pr->dest != NULL) {
+		size_t outsize = (pr->layout & PNMREADER_UINT16) ? 2 : 1;
+		size_t outch = (pr->layout & PNMREADER_RGB && !(pr->layout & PNMREADER_PLANAR)) ? 3 : 1;
+
+		if (outsize == 2 && ((uintptr_t)pr->dest % 2 || pr->dest_stride % 2)) {
+			return false;
+		}
+		if (pr->x1 - pr->x0 > pr->dest_stride / outch / outsize) {
+			return false;
+		}
+	}
+	// Keep the existing buffer if it's large enough:
+	if (size <= pr->rowbuf_size) {
+		return true;
 	}
+	free(pr->rowbuf);
+	if ((pr->rowbuf = malloc(size)) == NULL) {
+		pr->rowbuf_size = 0;
+		return false;
+	}
+	pr->rowbuf_size = size;
+	return true;
+}
+
+static bool
+alloc_scale (struct pnmreader *const pr)
+{
+	// Fill the table that scales the samples to the full range of the
+	// destination type. In PBM, 1 is black, so the table also inverts:
+	const uint32_t outmax = (pr->layout & PNMREADER_UINT16) ? 65535 : 255;
+	const bool invert = (pr->format == FORMAT_PBM_ASC || pr->format == FORMAT_PBM_BIN);
+
+	if ((pr->rescale = (invert || pr->maxval != outmax)) == false) {
+		return true;
+	}
+	if (pr->maxval >= pr->scale_size) {
+		free(pr->scale);
+		if ((pr->scale = malloc((pr->maxval + 1) * sizeof(*pr->scale))) == NULL) {
+			pr->scale_size = 0;
+			return false;
+		}
+		pr->scale_size = pr->maxval + 1;
+	}
+	for (uint32_t v = 0; v <= pr->maxval; v++) {
+		pr->scale[v] = (pr->maxval == 0) ? 0
+			: (((invert) ? pr->maxval - v : v) * outmax + pr->maxval / 2) / pr->maxval;
+	}
+	return true;
+}
+
+static inline bool
+full_roi (struct pnmreader *pr)
+{
+	return pr->x0 == 0 && pr->x1 == pr->width && pr->y0 == 0 && pr->y1 == pr->height;
+}
+
+// Defined after the bulk decoders:
+static void select_bulk (struct pnmreader *const pr);
+
+static inline uint64_t
+raster_rowsize (struct pnmreader *const pr)
+{
+	// Size of a row in a binary raster:
+	return (pr->format == FORMAT_PBM_BIN)
+		? ((uint64_t)pr->width + 7) / 8
+		: (uint64_t)pr->width * pr->channels * ((pr->maxval > 255) ? 2 : 1);
+}
+
+static enum pnmreader_result
+start_raster (struct pnmreader *const pr)
+{
+	// Called when the header is complete:
 	if (pr->maxval > 65535) {
 		return PNMREADER_UNSUPPORTED;
 	}
+	// Byte offsets in a binary raster are 64-bit:
+	if (pr->format >= FORMAT_PBM_BIN && raster_rowsize(pr) > UINT64_MAX / pr->height) {
+		return PNMREADER_UNSUPPORTED;
+	}
 	if (pr->got_maxval != NULL) {
-		if (pr->got_maxval(pr->maxval, pr->userdata) == false) {
+		if (USER_CALL(pr, header_callbacks, pr->got_maxval(pr->maxval, pr->userdata)) == false) {
 			return PNMREADER_ABORTED;
 		}
 	}
+	// Clip the region of interest, which the callbacks may have set:
+	pr->x0 = (pr->roi_x < pr->width) ? pr->roi_x : pr->width;
+	pr->x1 = pr->x0 + ((pr->roi_w < pr->width - pr->x0) ? pr->roi_w : pr->width - pr->x0);
+	pr->y0 = (pr->roi_y < pr->height) ? pr->roi_y : pr->height;
+	pr->y1 = pr->y0 + ((pr->roi_h < pr->height - pr->y0) ? pr->roi_h : pr->height - pr->y0);
+	if (pr->x0 == pr->x1) {
+		pr->y1 = pr->y0;
+	}
+
+	if (wants_rows(pr)) {
+		if (alloc_rowbuf(pr) == false) {
+			return PNMREADER_UNSUPPORTED;
+		}
+	}
+	if (pr->convert && alloc_scale(pr) == false) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	// A binary raster starts after the single whitespace character that
+	// pr->cur is on:
+	pr->raster = pr->streampos + (uint64_t)(pr->cur - pr->buf) + 1;
+	select_bulk(pr);
+
 	switch (pr->format)
 	{
 		case FORMAT_UNKNOWN: return PNMREADER_UNSUPPORTED; // Placate compiler
@@ -315,215 +735,619 @@ state_maxval (struct pnmreader *const pr)
 		case FORMAT_PBM_BIN: pr->state = STATE_BINDATA_PBM; break;
 		case FORMAT_PGM_BIN: pr->state = STATE_BINDATA_PGM; break;
 		case FORMAT_PPM_BIN: pr->state = STATE_BINDATA_PPM; break;
+		case FORMAT_PAM:     pr->state = STATE_BINDATA_PAM; break;
 	}
 	pr->substate = 0;
 	return PNMREADER_SUCCESS;
 }
 
 static enum pnmreader_result
-emit_pixel (struct pnmreader *const pr, unsigned int r, unsigned int g, unsigned int b)
-{
-	if (r > pr->maxval || g > pr->maxval || b > pr->maxval) {
-		return PNMREADER_INVALID_CHAR;
-	}
-	if (pr->got_pixel != NULL) {
-		if (pr->got_pixel(pr->col, pr->row, r, g, b, pr->userdata) == false) {
-			return PNMREADER_ABORTED;
-		}
-	}
-	pr->col++;
-	if (pr->col == pr->width) {
-		pr->col = 0;
-		pr->row++;
-	}
-	if (pr->row == pr->height) {
-		pr->state = STATE_FINISHED;
-		return PNMREADER_FINISHED;
-	}
-	return PNMREADER_SUCCESS;
-}
-
-static enum pnmreader_result
-state_ascdata_pbm (struct pnmreader *const pr)
+state_maxval (struct pnmreader *const pr)
 {
 	enum pnmreader_result res;
-	enum pnmreader_result emit_res;
 
+	// The bitmap formats do not have an explicit maxval in the file,
+	// which would be redundant, so just set it here and skip the read:
+	if (pr->format == FORMAT_PBM_ASC || pr->format == FORMAT_PBM_BIN) {
+		pr->maxval = 1;
+		pr->substate = 2;
+	}
 	switch (pr->substate)
 	{
-		for (;;)
-		{
-		case 0:	if ((res = skip_until_numeric(pr, true)) != PNMREADER_SUCCESS) {
+		case 0:	if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
 				return res;
 			}
-			pr->asciinum = 99;
+			pr->asciinum = 0;
 			pr->substate = 1;
 
-		case 1:	res = read_ascii_number(pr, true);
-			if (pr->asciinum <= 1) {
-				// With PBM ascii, we can still have read a valid number (0 or 1)
-				// while not being able to move on to the next digit. Try to detect
-				// that case: if pr->asciinum has changed, assume a valid digit:
-				if ((emit_res = emit_pixel(pr, pr->asciinum, pr->asciinum, pr->asciinum)) != PNMREADER_SUCCESS) {
-					return emit_res;
-				}
-			}
-			pr->substate = 0;
-			// Do the extra fetch for read_ascii_number if requested:
-			if (res != PNMREADER_SUCCESS) {
+		case 1:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
 				return res;
 			}
-		}
+			pr->maxval = pr->asciinum;
+			pr->substate = 2;
+
+		case 2:	break;
 	}
-	// Not reached, placate compiler:
-	__builtin_unreachable();
+	return start_raster(pr);
 }
 
 static enum pnmreader_result
-state_ascdata_pgm (struct pnmreader *const pr)
+skip_until_keyword (struct pnmreader *const pr)
 {
-	enum pnmreader_result res;
+	// Skip whitespace and comment lines in a PAM header, up to the
+	// keyword that starts the next line:
+	const unsigned char *end = pr->end;
 
-	switch (pr->substate)
-	{
-		for (;;)
-		{
-		case 0:	if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
-				return res;
+	for (;;) {
+		if (pr->charclass == CHAR_COMMENT) {
+			if ((pr->cur = (unsigned char *)find_eol(pr->cur, end)) == end) {
+				return PNMREADER_FEED_ME;
 			}
-			pr->asciinum = 0;
-			pr->substate = 1;
+			pr->charclass = CHAR_WHITESPACE;
+		}
+		if ((pr->cur = (unsigned char *)skip_whitespace(pr->cur, end)) == end) {
+			return PNMREADER_FEED_ME;
+		}
+		if (*pr->cur >= 'A' && *pr->cur <= 'Z') {
+			return PNMREADER_SUCCESS;
+		}
+		if (*pr->cur != '#') {
+			return PNMREADER_INVALID_CHAR;
+		}
+		pr->charclass = CHAR_COMMENT;
+		if (!increment_cur(pr)) {
+			return PNMREADER_FEED_ME;
+		}
+	}
+}
 
-		case 1:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
-				return res;
-			}
-			if ((res = emit_pixel(pr, pr->asciinum, pr->asciinum, pr->asciinum)) != PNMREADER_SUCCESS) {
-				return res;
+static enum pnmreader_result
+read_keyword (struct pnmreader *const pr)
+{
+	// Read an uppercase keyword up to the whitespace that ends it:
+	for (;;) {
+		if (*pr->cur < 'A' || *pr->cur > 'Z') {
+			if (charclass_table[0][*pr->cur] != CHAR_WHITESPACE) {
+				return PNMREADER_INVALID_CHAR;
 			}
-			pr->substate = 0;
+			pr->keyword[pr->keylen] = '\0';
+			return PNMREADER_SUCCESS;
+		}
+		if (pr->keylen == PAM_KEYWORD_MAX) {
+			return PNMREADER_INVALID_CHAR;
+		}
+		pr->keyword[pr->keylen++] = *pr->cur;
+		if (!increment_cur(pr)) {
+			return PNMREADER_FEED_ME;
 		}
 	}
-	// Not reached, placate compiler:
-	__builtin_unreachable();
 }
 
 static enum pnmreader_result
-state_ascdata_ppm (struct pnmreader *const pr)
+end_pam_header (struct pnmreader *const pr)
+{
+	// All fields but the tuple type are mandatory:
+	if (pr->width == 0 || pr->height == 0 || pr->channels == 0 || pr->maxval == 0) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	if (pr->width == UINT_MAX || pr->height == UINT_MAX || pr->channels > PAM_DEPTH_MAX) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	// From here on, the header is handled as in the PNM formats:
+	pr->charclass = CHAR_WHITESPACE;
+	pr->state = STATE_MAXVAL;
+	pr->substate = 2;
+	if (pr->got_geometry != NULL) {
+		if (USER_CALL(pr, header_callbacks, pr->got_geometry(pr->width, pr->height, pr->userdata)) == false) {
+			return PNMREADER_ABORTED;
+		}
+	}
+	return start_raster(pr);
+}
+
+static enum pnmreader_result
+state_pam_header (struct pnmreader *const pr)
 {
+	// The PAM header is a series of lines with a keyword and a value, in
+	// any order, up to a line with just ENDHDR. Substates:
+	// 0: skip whitespace and comments up to a keyword;
+	// 1: read the keyword;
+	// 2: skip to a numeric value;
+	// 3: read the numeric value;
+	// 4: skip the blanks before the tuple type;
+	// 5: read the tuple type up to the end of the line;
+	// 6: skip to the newline after ENDHDR, where the raster starts.
 	enum pnmreader_result res;
 
-	for (;;) {
+	for (;;)
+	{
 		switch (pr->substate)
 		{
-			case 0:
-			case 2:
-			case 4:	if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
+			case 0:	if ((res = skip_until_keyword(pr)) != PNMREADER_SUCCESS) {
 					return res;
 				}
-				pr->asciinum = 0;
-				pr->substate++;
+				pr->keylen = 0;
+				pr->substate = 1;
 
-			case 1:
-			case 3:
-			case 5:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
+			case 1:	if ((res = read_keyword(pr)) != PNMREADER_SUCCESS) {
 					return res;
 				}
-				if (pr->substate == 1) {
-					pr->r = pr->asciinum;
-					pr->substate++;
-					continue;
+				if (strcmp(pr->keyword, "ENDHDR") == 0) {
+					pr->substate = 6;
+					break;
 				}
-				if (pr->substate == 3) {
-					pr->g = pr->asciinum;
-					pr->substate++;
-					continue;
+				// The values of repeated TUPLTYPE lines are
+				// joined with a space:
+				if (strcmp(pr->keyword, "TUPLTYPE") == 0) {
+					if (pr->tupllen > 0) {
+						if (pr->tupllen == PAM_TUPLTYPE_MAX) {
+							return PNMREADER_UNSUPPORTED;
+						}
+						pr->tupltype[pr->tupllen++] = ' ';
+					}
+					pr->substate = 4;
+					break;
 				}
-				if ((res = emit_pixel(pr, pr->r, pr->g, pr->asciinum)) != PNMREADER_SUCCESS) {
+				if (strcmp(pr->keyword, "WIDTH") != 0
+				 && strcmp(pr->keyword, "HEIGHT") != 0
+				 && strcmp(pr->keyword, "DEPTH") != 0
+				 && strcmp(pr->keyword, "MAXVAL") != 0) {
+					return PNMREADER_INVALID_CHAR;
+				}
+				pr->substate = 2;
+
+			case 2:	if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
+					return res;
+				}
+				pr->asciinum = 0;
+				pr->substate = 3;
+
+			case 3:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
 					return res;
 				}
+				switch (pr->keyword[0]) {
+					case 'W': pr->width = pr->asciinum; break;
+					case 'H': pr->height = pr->asciinum; break;
+					case 'D': pr->channels = pr->asciinum; break;
+					default : pr->maxval = pr->asciinum; break;
+				}
+				pr->substate = 0;
+				break;
+
+			case 4:	while (*pr->cur == ' ' || *pr->cur == '\t') {
+					if (!increment_cur(pr)) {
+						return PNMREADER_FEED_ME;
+					}
+				}
+				pr->substate = 5;
+
+			case 5:	while (*pr->cur != '\n' && *pr->cur != '\r') {
+					if (pr->tupllen == PAM_TUPLTYPE_MAX) {
+						return PNMREADER_UNSUPPORTED;
+					}
+					pr->tupltype[pr->tupllen++] = *pr->cur;
+					if (!increment_cur(pr)) {
+						return PNMREADER_FEED_ME;
+					}
+				}
+				while (pr->tupllen > 0 && (pr->tupltype[pr->tupllen - 1] == ' ' || pr->tupltype[pr->tupllen - 1] == '\t')) {
+					pr->tupllen--;
+				}
+				pr->tupltype[pr->tupllen] = '\0';
+				pr->charclass = CHAR_WHITESPACE;
 				pr->substate = 0;
+				break;
+
+			case 6:	while (*pr->cur != '\n') {
+					if (*pr->cur != ' ' && *pr->cur != '\t' && *pr->cur != '\r') {
+						return PNMREADER_INVALID_CHAR;
+					}
+					if (!increment_cur(pr)) {
+						return PNMREADER_FEED_ME;
+					}
+				}
+				return end_pam_header(pr);
+		}
+	}
+}
+
+static inline unsigned char *
+row_dst (struct pnmreader *const pr)
+{
+	// Where the current row is assembled:
+	return (pr->dest != NULL && pr->convert == false)
+		? pr->dest + (size_t)(pr->row - pr->y0) * pr->dest_stride
+		: pr->rowbuf;
+}
+
+static inline void
+store_pixel (struct pnmreader *const pr, unsigned int r, unsigned int g, unsigned int b, const unsigned int channels, const bool wide)
+{
+	// Store the pixel in the row buffer for the got_row callback:
+	if (wide) {
+		uint16_t *s = (uint16_t *)row_dst(pr) + (size_t)(pr->col - pr->x0) * channels;
+		if (channels == 1) {
+			s[0] = r;
+			return;
+		}
+		s[0] = r;
+		s[1] = g;
+		s[2] = b;
+		return;
+	}
+	uint8_t *s = row_dst(pr) + (size_t)(pr->col - pr->x0) * channels;
+	if (channels == 1) {
+		s[0] = r;
+		return;
+	}
+	s[0] = r;
+	s[1] = g;
+	s[2] = b;
+}
+
+static inline void
+convert_channel (unsigned char *dst, size_t dstep, const unsigned char *src, size_t sstep, size_t n, const uint16_t *scale, const bool in16, const bool out16)
+{
+	// Copy one channel of a row, scaling the samples if there is a table.
+	// Inlined with constant sample sizes, this yields a loop per case:
+	for (size_t i = 0; i < n; i++) {
+		unsigned int v = (in16) ? ((const uint16_t *)src)[i * sstep] : src[i * sstep];
+
+		if (scale != NULL) {
+			v = scale[v];
+		}
+		if (out16) {
+			((uint16_t *)dst)[i * dstep] = v;
+		}
+		else {
+			dst[i * dstep] = v;
+		}
+	}
+}
+
+static inline void
+convert_luma (unsigned char *dst, const unsigned char *src, size_t sstep, size_t n, const uint16_t *scale, const bool in16, const bool out16)
+{
+	// Convert a row of color pixels to gray, with the Rec. 601 weights:
+	for (size_t i = 0; i < n; i++) {
+		unsigned int c[3];
+
+		for (int j = 0; j < 3; j++) {
+			c[j] = (in16) ? ((const uint16_t *)src)[i * sstep + j] : src[i * sstep + j];
+			if (scale != NULL) {
+				c[j] = scale[c[j]];
+			}
+		}
+		unsigned int v = (c[0] * 77 + c[1] * 150 + c[2] * 29 + 128) >> 8;
+
+		if (out16) {
+			((uint16_t *)dst)[i] = v;
+		}
+		else {
+			dst[i] = v;
+		}
+	}
+}
+
+static void
+convert_row (struct pnmreader *const pr, const unsigned char *samples)
+{
+	// Convert a row in the native layout into the destination buffer:
+	const bool in16 = (pr->maxval > 255);
+	const bool out16 = (pr->layout & PNMREADER_UINT16);
+	const bool planar = (pr->layout & PNMREADER_PLANAR);
+	const unsigned int outch = (pr->layout & PNMREADER_RGB) ? 3 : 1;
+	const size_t outsize = (out16) ? 2 : 1;
+	const size_t npixels = pr->x1 - pr->x0;
+	const size_t plane = (size_t)(pr->y1 - pr->y0) * pr->dest_stride;
+	const uint16_t *scale = (pr->rescale) ? pr->scale : NULL;
+	unsigned char *dst = pr->dest + (size_t)(pr->row - pr->y0) * pr->dest_stride;
+
+	// Straight copy if the layouts are the same:
+	if (scale == NULL && in16 == out16 && pr->channels == outch && (outch == 1 || !planar)) {
+		memcpy(dst, samples, npixels * outch * outsize);
+		return;
+	}
+	if (outch == 1 && pr->channels >= 3) {
+		if (in16) {
+			(out16)
+				? convert_luma(dst, samples, pr->channels, npixels, scale, true, true)
+				: convert_luma(dst, samples, pr->channels, npixels, scale, true, false);
+		}
+		else {
+			(out16)
+				? convert_luma(dst, samples, pr->channels, npixels, scale, false, true)
+				: convert_luma(dst, samples, pr->channels, npixels, scale, false, false);
+		}
+		return;
+	}
+	for (unsigned int c = 0; c < outch; c++)
+	{
+		// Gray samples are replicated into all channels. For PAM, the
+		// first sample or the first three are used, as for got_pixel:
+		const unsigned char *src = samples + ((pr->channels >= 3) ? c : 0) * ((in16) ? 2 : 1);
+		unsigned char *d = (planar) ? dst + c * plane : dst + c * outsize;
+		const size_t dstep = (planar) ? 1 : outch;
+
+		if (in16) {
+			(out16)
+				? convert_channel(d, dstep, src, pr->channels, npixels, scale, true, true)
+				: convert_channel(d, dstep, src, pr->channels, npixels, scale, true, false);
+		}
+		else {
+			(out16)
+				? convert_channel(d, dstep, src, pr->channels, npixels, scale, false, true)
+				: convert_channel(d, dstep, src, pr->channels, npixels, scale, false, false);
+		}
+	}
+}
+
+static inline bool
+put_row (struct pnmreader *const pr, const unsigned char *samples)
+{
+	// Pass on a complete row of the region of interest:
+	if (pr->convert) {
+		convert_row(pr, samples);
+	}
+	if (pr->pulling) {
+		size_t size = (size_t)(pr->x1 - pr->x0) * pr->channels * ((pr->maxval > 255) ? 2 : 1);
+
+		memcpy(pr->pull + (size_t)pr->pull_rows++ * pr->pull_stride, samples, size);
+	}
+	return (pr->got_row == NULL || USER_CALL(pr, row_callbacks, pr->got_row(pr->row, samples, pr->userdata)));
+}
+
+static inline enum pnmreader_result
+end_of_row (struct pnmreader *const pr)
+{
+	pr->col = 0;
+	pr->row++;
+	if (pr->row == pr->height) {
+		pr->state = STATE_FINISHED;
+		return PNMREADER_FINISHED;
+	}
+	// In a binary raster, skip the rows below the region of interest
+	// without decoding them. The image is finished after the skip:
+	if (pr->row == pr->y1 && pr->format >= FORMAT_PBM_BIN) {
+		pr->seek = raster_rowsize(pr) * (pr->height - pr->row);
+		pr->row = pr->height;
+		pr->state = STATE_FINISHED;
+		return PNMREADER_FINISHED;
+	}
+	return (pr->pulling && pr->pull_rows == pr->pull_max)
+		? PNMREADER_PAUSED
+		: PNMREADER_SUCCESS;
+}
+
+static inline void
+skip_rows_above (struct pnmreader *const pr)
+{
+	// In a binary raster, skip the rows above the region of interest
+	// without decoding them. An empty region skips the whole raster:
+	if (pr->y0 == pr->y1) {
+		pr->seek = raster_rowsize(pr) * pr->height;
+		pr->row = pr->height;
+		pr->state = STATE_FINISHED;
+		return;
+	}
+	pr->seek = raster_rowsize(pr) * pr->y0;
+	pr->row = pr->y0;
+}
+
+static inline enum pnmreader_result
+after_rows_above (struct pnmreader *const pr)
+{
+	// Return to the main loop to apply a pending skip:
+	return (pr->state == STATE_FINISHED) ? PNMREADER_FINISHED : PNMREADER_SUCCESS;
+}
+
+static inline enum pnmreader_result
+next_pixel (struct pnmreader *const pr, bool in_rows)
+{
+	// Advance to the next pixel, passing on the row when its part in the
+	// region of interest is complete:
+	pr->col++;
+	if (pr->col == pr->x1 && in_rows) {
+		if (put_row(pr, row_dst(pr)) == false) {
+			return PNMREADER_ABORTED;
+		}
+	}
+	if (pr->col < pr->width) {
+		return PNMREADER_SUCCESS;
+	}
+	return end_of_row(pr);
+}
+
+static inline enum pnmreader_result
+emit_pixel_as (struct pnmreader *const pr, unsigned int r, unsigned int g, unsigned int b, const unsigned int channels, const bool wide, const bool callback, const bool roi)
+{
+	// Pass on a pixel. The bulk decoders inline this with constant
+	// parameters: without a region of interest, every pixel is in it:
+	const bool in_rows = (!roi || (pr->row >= pr->y0 && pr->row < pr->y1));
+	const bool in_roi = (in_rows && (!roi || (pr->col >= pr->x0 && pr->col < pr->x1)));
+
+	// Binary rasters skip the columns outside the region of interest
+	// unchecked, like bindata_bulk() does, so that the result does not
+	// depend on how the input was fed:
+	if ((in_roi || pr->format < FORMAT_PBM_BIN) && (r > pr->maxval || g > pr->maxval || b > pr->maxval)) {
+		return PNMREADER_INVALID_CHAR;
+	}
+	// Only pixels in the region of interest are passed on:
+	if (in_roi) {
+		if (callback) {
+			if (USER_CALL(pr, pixel_callbacks, pr->got_pixel(pr->col, pr->row, r, g, b, pr->userdata)) == false) {
+				return PNMREADER_ABORTED;
+			}
+		}
+		if (pr->rowbuf != NULL || pr->dest != NULL) {
+			store_pixel(pr, r, g, b, channels, wide);
 		}
 	}
+	return next_pixel(pr, in_rows);
 }
 
 static enum pnmreader_result
-state_bindata_pbm (struct pnmreader *const pr)
+emit_pixel (struct pnmreader *const pr, unsigned int r, unsigned int g, unsigned int b)
+{
+	// Generic version for the bytewise states. These cannot stop halfway
+	// a substate, so a full batch of rows is left to the next call of the
+	// bulk decoder, which checks for it on entry:
+	enum pnmreader_result res = emit_pixel_as(pr, r, g, b, pr->channels, pr->maxval > 255, pr->got_pixel != NULL, true);
+
+	return (res == PNMREADER_PAUSED) ? PNMREADER_SUCCESS : res;
+}
+
+static enum pnmreader_result
+emit_sample (struct pnmreader *const pr, unsigned int v)
 {
+	// Handle a single sample of a PAM tuple, for tuples that straddle two
+	// buffers. The first three samples are kept for got_pixel:
+	const bool in_rows = (pr->row >= pr->y0 && pr->row < pr->y1);
+	const bool in_roi = (in_rows && pr->col >= pr->x0 && pr->col < pr->x1);
 	enum pnmreader_result res;
 
-	switch (pr->substate)
+	// PAM is binary, so samples outside the region of interest are not
+	// checked, as in emit_pixel_as():
+	if (in_roi && v > pr->maxval) {
+		return PNMREADER_INVALID_CHAR;
+	}
+	switch (pr->sample) {
+		case 0: pr->r = pr->g = pr->b = v; break;
+		case 1: pr->g = (pr->channels >= 3) ? v : pr->g; break;
+		case 2: pr->b = v; break;
+	}
+	if (in_roi && (pr->rowbuf != NULL || pr->dest != NULL)) {
+		size_t i = (size_t)(pr->col - pr->x0) * pr->channels + pr->sample;
+
+		if (pr->maxval > 255) {
+			((uint16_t *)row_dst(pr))[i] = v;
+		}
+		else {
+			row_dst(pr)[i] = v;
+		}
+	}
+	if (++pr->sample < pr->channels) {
+		return PNMREADER_SUCCESS;
+	}
+	pr->sample = 0;
+	if (in_roi && pr->got_pixel != NULL) {
+		if (USER_CALL(pr, pixel_callbacks, pr->got_pixel(pr->col, pr->row, pr->r, pr->g, pr->b, pr->userdata)) == false) {
+			return PNMREADER_ABORTED;
+		}
+	}
+	// As in emit_pixel(), a full batch of rows is left to the bulk decoder:
+	return ((res = next_pixel(pr, in_rows)) == PNMREADER_PAUSED) ? PNMREADER_SUCCESS : res;
+}
+
+static inline enum pnmreader_result
+ascdata_bulk (struct pnmreader *const pr, const bool is_binary, const unsigned int channels, const bool wide, const bool callback, const bool roi)
+{
+	// Fast path for the plain formats: lex whole pixels at once while they
+	// are guaranteed to fit in the buffer. Returns PNMREADER_SUCCESS when
+	// the rest is left to the bytewise state machine, with pr->cur at the
+	// start of a pixel. Instantiated per format below.
+	const unsigned char *p = pr->cur;
+	const unsigned char *end = pr->end;
+	enum pnmreader_result res;
+	unsigned int v[3];
+
+	if (pr->charclass == CHAR_COMMENT) {
+		return PNMREADER_SUCCESS;
+	}
+	for (;;)
 	{
-		case 0:	pr->substate = 1;
-			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
-				return res;
-			}
+		const unsigned char *start = p;
 
-		for (;;)
+		for (unsigned int i = 0; i < channels; i++)
 		{
-		case 1:	for (int i = 7; i >= 0; i--) {
-				pr->r = (*pr->cur >> i) & 1;
-				if ((res = emit_pixel(pr, pr->r, pr->r, pr->r)) != PNMREADER_SUCCESS) {
-					return res;
+			// Skip whitespace and comments:
+			for (;;) {
+				if ((p = skip_whitespace(p, end)) == end || *p != '#') {
+					break;
 				}
-				// Vagaries of the format: the bits are packed per row,
-				// and the last byte of the row may contain filler:
-				if (pr->col == 0) {
+				if ((p = find_eol(p, end)) == end) {
 					break;
 				}
 			}
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
+			// Plain PBM has single-digit samples, which need not be
+			// separated by whitespace:
+			if (is_binary) {
+				if (p == end || charclass_table[1][*p] != CHAR_NUMERIC) {
+					goto slow;
+				}
+				v[i] = *p++ - '0';
+				continue;
+			}
+			// Leave numbers that are long or cut off by the end of
+			// the buffer to the state machine:
+			if (end - p < 8) {
+				goto slow;
+			}
+			uint64_t text = load_le64(p);
+			unsigned int ndigits = count_digits(text);
+
+			if (ndigits == 0 || ndigits == 8) {
+				goto slow;
+			}
+			v[i] = parse_digits(text, ndigits);
+			p += ndigits;
+
+			// The number must be terminated by whitespace or a comment:
+			if ((pr->charclass = charclass_table[0][*p]) == CHAR_INVALID) {
+				goto slow;
 			}
 		}
+		pr->cur = (unsigned char *)p;
+		res = (channels == 3)
+			? emit_pixel_as(pr, v[0], v[1], v[2], channels, wide, callback, roi)
+			: emit_pixel_as(pr, v[0], v[0], v[0], channels, wide, callback, roi);
+
+		if (res != PNMREADER_SUCCESS) {
+			return res;
+		}
+		continue;
+
+slow:		pr->cur = (unsigned char *)start;
+		pr->charclass = CHAR_WHITESPACE;
+		return (start < end)
+			? PNMREADER_SUCCESS
+			: PNMREADER_FEED_ME;
 	}
-	// Not reached, placate compiler:
-	__builtin_unreachable();
 }
 
 static enum pnmreader_result
-state_bindata_pgm (struct pnmreader *const pr)
+state_ascdata_pbm (struct pnmreader *const pr)
 {
 	enum pnmreader_result res;
+	enum pnmreader_result emit_res;
 
 	switch (pr->substate)
 	{
-		case 0:	pr->substate = (pr->maxval > 255) ? 2 : 1;
-			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
-				return res;
-			}
-			if (pr->substate == 2) {
-				goto state_2;
-			}
-
 		for (;;)
 		{
-		case 1:	// Single-byte PGM:
-			pr->r = *pr->cur;
-			if ((res = emit_pixel(pr, pr->r, pr->r, pr->r)) != PNMREADER_SUCCESS) {
+		case 0:	if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
 				return res;
 			}
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
+			if ((res = skip_until_numeric(pr, true)) != PNMREADER_SUCCESS) {
+				return res;
 			}
-		}
+			pr->asciinum = 99;
+			pr->substate = 1;
 
-		for (;;)
-		{
-state_2:	case 2:	// Double-byte PGM:
-			pr->r = *pr->cur;
-			pr->substate = 3;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
+		case 1:	res = read_ascii_number(pr, true);
+			if (pr->asciinum <= 1) {
+				// With PBM ascii, we can still have read a valid number (0 or 1)
+				// while not being able to move on to the next digit. Try to detect
+				// that case: if pr->asciinum has changed, assume a valid digit:
+				if ((emit_res = emit_pixel(pr, pr->asciinum, pr->asciinum, pr->asciinum)) != PNMREADER_SUCCESS) {
+					return emit_res;
+				}
 			}
-
-		case 3:	pr->r = ((pr->r << 8) | *pr->cur);
-			if ((res = emit_pixel(pr, pr->r, pr->r, pr->r)) != PNMREADER_SUCCESS) {
+			pr->substate = 0;
+			// Do the extra fetch for read_ascii_number if requested:
+			if (res != PNMREADER_SUCCESS) {
 				return res;
 			}
-			pr->substate = 2;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
-			}
 		}
 	}
 	// Not reached, placate compiler:
@@ -531,174 +1355,1653 @@ state_2:	case 2:	// Double-byte PGM:
 }
 
 static enum pnmreader_result
-state_bindata_ppm (struct pnmreader *const pr)
+state_ascdata_pgm (struct pnmreader *const pr)
 {
 	enum pnmreader_result res;
 
 	switch (pr->substate)
 	{
-		case 0:	pr->substate = (pr->maxval > 255) ? 4 : 1;
-			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
-				return res;
-			}
-			if (pr->substate == 4) {
-				goto state_4;
-			}
-
 		for (;;)
 		{
-		case 1:	// Single-byte PPM:
-			pr->r = *pr->cur;
-			pr->substate = 2;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
+		case 0:	if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
 			}
-
-		case 2:	pr->g = *pr->cur;
-			pr->substate = 3;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
+			if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
+				return res;
 			}
+			pr->asciinum = 0;
+			pr->substate = 1;
 
-		case 3:	if ((res = emit_pixel(pr, pr->r, pr->g, *pr->cur)) != PNMREADER_SUCCESS) {
+		case 1:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
 				return res;
 			}
-			pr->substate = 1;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
+			if ((res = emit_pixel(pr, pr->asciinum, pr->asciinum, pr->asciinum)) != PNMREADER_SUCCESS) {
+				return res;
 			}
+			pr->substate = 0;
 		}
+	}
+	// Not reached, placate compiler:
+	__builtin_unreachable();
+}
 
-		for (;;)
-		{
-state_4:	case 4:	// Double-byte PPM:
-			pr->r = *pr->cur;
-			pr->substate = 5;
-			if (!increment_cur(pr)) {
+static enum pnmreader_result
+state_ascdata_ppm (struct pnmreader *const pr)
+{
+	enum pnmreader_result res;
+
+	for (;;) {
+		switch (pr->substate)
+		{
+			case 0:	if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+					return res;
+				}
+
+			case 2:
+			case 4:	if ((res = skip_until_numeric(pr, false)) != PNMREADER_SUCCESS) {
+					return res;
+				}
+				pr->asciinum = 0;
+				pr->substate++;
+
+			case 1:
+			case 3:
+			case 5:	if ((res = read_ascii_number(pr, false)) != PNMREADER_SUCCESS) {
+					return res;
+				}
+				if (pr->substate == 1) {
+					pr->r = pr->asciinum;
+					pr->substate++;
+					continue;
+				}
+				if (pr->substate == 3) {
+					pr->g = pr->asciinum;
+					pr->substate++;
+					continue;
+				}
+				if ((res = emit_pixel(pr, pr->r, pr->g, pr->asciinum)) != PNMREADER_SUCCESS) {
+					return res;
+				}
+				pr->substate = 0;
+		}
+	}
+}
+
+// Returns the number of leading 8-bit samples that do not exceed maxval:
+static size_t
+check_range_8 (const uint8_t *p, size_t n, unsigned int maxval)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i lim32 = _mm256_set1_epi8((char)maxval);
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i ok = _mm256_cmpeq_epi8(_mm256_max_epu8(v, lim32), lim32);
+		unsigned int mask = _mm256_movemask_epi8(ok);
+		if (mask != 0xFFFFFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lim16 = _mm_set1_epi8((char)maxval);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i ok = _mm_cmpeq_epi8(_mm_max_epu8(v, lim16), lim16);
+		unsigned int mask = _mm_movemask_epi8(ok);
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (p[i] > maxval) {
+			break;
+		}
+	}
+	return i;
+}
+
+// Returns the number of leading big-endian 16-bit samples that do not exceed
+// maxval:
+static size_t
+check_range_16 (const uint8_t *p, size_t n, unsigned int maxval)
+{
+	size_t i = 0;
+
+	// Samples are compared with saturating subtraction, which yields zero
+	// for every sample that is in range. The byte order is swapped first:
+#if defined(__AVX2__)
+	const __m256i lim32 = _mm256_set1_epi16((short)maxval);
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i * 2));
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		__m256i ok = _mm256_cmpeq_epi16(_mm256_subs_epu16(v, lim32), _mm256_setzero_si256());
+		unsigned int mask = _mm256_movemask_epi8(ok);
+		if (mask != 0xFFFFFFFF) {
+			return i + __builtin_ctz(~mask) / 2;
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lim16 = _mm_set1_epi16((short)maxval);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i * 2));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		__m128i ok = _mm_cmpeq_epi16(_mm_subs_epu16(v, lim16), _mm_setzero_si128());
+		unsigned int mask = _mm_movemask_epi8(ok);
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask) / 2;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (((unsigned int)p[i * 2] << 8 | p[i * 2 + 1]) > maxval) {
+			break;
+		}
+	}
+	return i;
+}
+
+// Convert big-endian 16-bit samples to native byte order:
+static void
+swap_16 (uint16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] = (uint16_t)(src[i * 2] << 8 | src[i * 2 + 1]);
+	}
+}
+
+static inline enum pnmreader_result
+bindata_bulk (struct pnmreader *const pr, const size_t samplesize, const unsigned int nchannels, const bool callback, const bool roi)
+{
+	// Fast path for binary PGM, PPM and PAM: process all whole pixels in the
+	// buffer at once, one run per row. Returns PNMREADER_SUCCESS when it
+	// leaves a partial pixel or an out-of-range sample at pr->cur, which
+	// is left to the bytewise state machine. Instantiated per format below;
+	// the PAM depth is only known at runtime, passed as zero:
+	const size_t channels = (nchannels > 0) ? nchannels : pr->channels;
+	const size_t pixelsize = samplesize * channels;
+	const unsigned char *end = pr->end;
+	enum pnmreader_result res;
+
+	for (;;)
+	{
+		size_t npixels = (size_t)(end - pr->cur) / pixelsize;
+		size_t nvalid;
+		bool row_sent = false;
+
+		if (npixels == 0) {
+			return (pr->cur < end)
+				? PNMREADER_SUCCESS
+				: PNMREADER_FEED_ME;
+		}
+		// Skip the columns left and right of the region of interest,
+		// without checking them:
+		if (roi && (pr->col < pr->x0 || pr->col >= pr->x1)) {
+			size_t nskip = ((pr->col < pr->x0) ? pr->x0 : pr->width) - pr->col;
+
+			if (nskip > npixels) {
+				nskip = npixels;
+			}
+			pr->cur += nskip * pixelsize;
+			pr->col += nskip;
+			if (pr->col == pr->width && (res = end_of_row(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			continue;
+		}
+		if (npixels > pr->x1 - pr->col) {
+			npixels = pr->x1 - pr->col;
+		}
+		// Range-check the samples, clip the run to the valid part:
+		nvalid = npixels * channels;
+		if (samplesize == 1 && pr->maxval < 255) {
+			nvalid = check_range_8(pr->cur, nvalid, pr->maxval);
+		}
+		if (samplesize == 2 && pr->maxval < 65535) {
+			nvalid = check_range_16(pr->cur, nvalid, pr->maxval);
+		}
+		if ((npixels = nvalid / channels) == 0) {
+			return PNMREADER_SUCCESS;
+		}
+		if (callback) {
+			const unsigned char *p = pr->cur;
+			const size_t g = (channels >= 3) ? samplesize : 0;
+			const size_t b = g * 2;
+
+			for (size_t i = 0; i < npixels; i++, p += pixelsize) {
+				bool ok = (samplesize == 1)
+					? USER_CALL(pr, pixel_callbacks, pr->got_pixel(pr->col + i, pr->row, p[0], p[g], p[b], pr->userdata))
+					: USER_CALL(pr, pixel_callbacks, pr->got_pixel(pr->col + i, pr->row,
+						p[0] << 8 | p[1],
+						p[g] << 8 | p[g + 1],
+						p[b] << 8 | p[b + 1],
+						pr->userdata));
+				if (ok == false) {
+					pr->cur = (unsigned char *)p;
+					pr->col += i;
+					return PNMREADER_ABORTED;
+				}
+			}
+		}
+		if (wants_rows(pr)) {
+			// A whole row of 8-bit samples can be passed as-is:
+			if (samplesize == 1 && pr->col == pr->x0 && npixels == pr->x1 - pr->x0 && (pr->dest == NULL || pr->convert)) {
+				if (put_row(pr, pr->cur) == false) {
+					return PNMREADER_ABORTED;
+				}
+				row_sent = true;
+			}
+			else if (samplesize == 1) {
+				memcpy(row_dst(pr) + (size_t)(pr->col - pr->x0) * pixelsize, pr->cur, npixels * pixelsize);
+			}
+			else {
+				swap_16((uint16_t *)row_dst(pr) + (size_t)(pr->col - pr->x0) * channels, pr->cur, npixels * channels);
+			}
+		}
+		pr->cur += npixels * pixelsize;
+		pr->col += npixels;
+
+		// Stop if the run was cut short by an invalid sample:
+		if (pr->col < pr->x1) {
+			return (pr->cur < end)
+				? PNMREADER_SUCCESS
+				: PNMREADER_FEED_ME;
+		}
+		if (row_sent == false && put_row(pr, row_dst(pr)) == false) {
+			return PNMREADER_ABORTED;
+		}
+		if (pr->col == pr->width && (res = end_of_row(pr)) != PNMREADER_SUCCESS) {
+			return res;
+		}
+	}
+}
+
+// Lookup table that expands a byte of packed PBM pixels into eight samples,
+// most significant bit first:
+#define PBM_BYTE(n)	{ (n) >> 7 & 1, (n) >> 6 & 1, (n) >> 5 & 1, (n) >> 4 & 1, \
+			  (n) >> 3 & 1, (n) >> 2 & 1, (n) >> 1 & 1, (n) & 1 }
+#define PBM_BYTE4(n)	PBM_BYTE(n), PBM_BYTE(n + 1), PBM_BYTE(n + 2), PBM_BYTE(n + 3)
+#define PBM_BYTE16(n)	PBM_BYTE4(n), PBM_BYTE4(n + 4), PBM_BYTE4(n + 8), PBM_BYTE4(n + 12)
+#define PBM_BYTE64(n)	PBM_BYTE16(n), PBM_BYTE16(n + 16), PBM_BYTE16(n + 32), PBM_BYTE16(n + 48)
+
+static const uint8_t pbm_table[256][8] = {
+	PBM_BYTE64(0), PBM_BYTE64(64), PBM_BYTE64(128), PBM_BYTE64(192)
+};
+
+static inline enum pnmreader_result
+bindata_pbm_bulk (struct pnmreader *const pr, const bool callback, const bool roi)
+{
+	// Vagaries of the format: the bits are packed per row, and the last
+	// byte of the row may contain filler. Process the buffer in runs of
+	// whole bytes that end at most at the end of the row, so that the
+	// filler only needs to be handled once per row:
+	const unsigned char *end = pr->end;
+	enum pnmreader_result res;
+
+	for (;;)
+	{
+		size_t nbytes = (size_t)(end - pr->cur);
+		size_t rowbytes = ((size_t)pr->width - pr->col + 7) / 8;
+		size_t npixels;
+		size_t first;
+		size_t last;
+
+		if (nbytes == 0) {
+			return PNMREADER_FEED_ME;
+		}
+		if (nbytes >= rowbytes) {
+			nbytes = rowbytes;
+			npixels = pr->width - pr->col;
+		}
+		else {
+			npixels = nbytes * 8;
+		}
+		// The pixels of the run in the region of interest:
+		first = (roi && pr->col < pr->x0) ? pr->x0 - pr->col : 0;
+		last = (roi && pr->col >= pr->x1) ? 0 : (roi) ? pr->x1 - pr->col : npixels;
+		if (first > npixels) {
+			first = npixels;
+		}
+		if (last > npixels) {
+			last = npixels;
+		}
+		if (callback) {
+			for (size_t i = first; i < last; i++) {
+				unsigned int bit = pbm_table[pr->cur[i / 8]][i % 8];
+
+				if (USER_CALL(pr, pixel_callbacks, pr->got_pixel(pr->col + i, pr->row, bit, bit, bit, pr->userdata)) == false) {
+					return PNMREADER_ABORTED;
+				}
+			}
+		}
+		if (wants_rows(pr) && first < last) {
+			uint8_t *dst = row_dst(pr) + (pr->col + first - pr->x0);
+			size_t i = first;
+
+			// Expand single pixels up to a byte boundary, then whole
+			// bytes:
+			for (; i < last && i % 8; i++) {
+				*dst++ = pbm_table[pr->cur[i / 8]][i % 8];
+			}
+			for (; i + 8 <= last; i += 8, dst += 8) {
+				memcpy(dst, pbm_table[pr->cur[i / 8]], 8);
+			}
+			if (i < last) {
+				memcpy(dst, pbm_table[pr->cur[i / 8]], last - i);
+			}
+		}
+		pr->cur += nbytes;
+		pr->col += npixels;
+
+		if (pr->col < pr->width) {
+			return PNMREADER_FEED_ME;
+		}
+		if (put_row(pr, row_dst(pr)) == false) {
+			return PNMREADER_ABORTED;
+		}
+		if ((res = end_of_row(pr)) != PNMREADER_SUCCESS) {
+			return res;
+		}
+	}
+}
+
+// Instantiate a bulk decoder with constant format parameters, in four
+// variants: with and without a pixel callback, and with and without a region
+// of interest. Within each one, the compiler drops the branches on the
+// parameters from the inner loops. In pull mode, the decoders do not start
+// when the batch of rows is already full:
+#define BULK_KERNEL(name, fn, ...) \
+	static enum pnmreader_result \
+	name (struct pnmreader *const pr) \
+	{ \
+		if (pr->pulling && pr->pull_rows == pr->pull_max) { \
+			return PNMREADER_PAUSED; \
+		} \
+		return fn(__VA_ARGS__); \
+	}
+
+#define BULK_KERNELS(name, fn, ...) \
+	BULK_KERNEL(name,        fn, __VA_ARGS__, false, false) \
+	BULK_KERNEL(name##_cb,     fn, __VA_ARGS__, true,  false) \
+	BULK_KERNEL(name##_roi,    fn, __VA_ARGS__, false, true) \
+	BULK_KERNEL(name##_cb_roi, fn, __VA_ARGS__, true,  true)
+
+#define BULK_TABLE(name) \
+	{ name, name##_cb, name##_roi, name##_cb_roi }
+
+BULK_KERNELS(ascdata_pbm,    ascdata_bulk, pr, true,  1, false)
+BULK_KERNELS(ascdata_pgm_8,  ascdata_bulk, pr, false, 1, false)
+BULK_KERNELS(ascdata_pgm_16, ascdata_bulk, pr, false, 1, true)
+BULK_KERNELS(ascdata_ppm_8,  ascdata_bulk, pr, false, 3, false)
+BULK_KERNELS(ascdata_ppm_16, ascdata_bulk, pr, false, 3, true)
+BULK_KERNELS(bindata_pbm,    bindata_pbm_bulk, pr)
+BULK_KERNELS(bindata_pgm_8,  bindata_bulk, pr, 1, 1)
+BULK_KERNELS(bindata_pgm_16, bindata_bulk, pr, 2, 1)
+BULK_KERNELS(bindata_ppm_8,  bindata_bulk, pr, 1, 3)
+BULK_KERNELS(bindata_ppm_16, bindata_bulk, pr, 2, 3)
+BULK_KERNELS(bindata_pam_8,  bindata_bulk, pr, 1, 0)
+BULK_KERNELS(bindata_pam_16, bindata_bulk, pr, 2, 0)
+
+// The bulk decoders by format and by 8- or 16-bit samples:
+static enum pnmreader_result (*const bulk_table[][2][4])(struct pnmreader *) = {
+	[FORMAT_PBM_ASC] = { BULK_TABLE(ascdata_pbm),    BULK_TABLE(ascdata_pbm)    },
+	[FORMAT_PGM_ASC] = { BULK_TABLE(ascdata_pgm_8),  BULK_TABLE(ascdata_pgm_16) },
+	[FORMAT_PPM_ASC] = { BULK_TABLE(ascdata_ppm_8),  BULK_TABLE(ascdata_ppm_16) },
+	[FORMAT_PBM_BIN] = { BULK_TABLE(bindata_pbm),    BULK_TABLE(bindata_pbm)    },
+	[FORMAT_PGM_BIN] = { BULK_TABLE(bindata_pgm_8),  BULK_TABLE(bindata_pgm_16) },
+	[FORMAT_PPM_BIN] = { BULK_TABLE(bindata_ppm_8),  BULK_TABLE(bindata_ppm_16) },
+	[FORMAT_PAM]     = { BULK_TABLE(bindata_pam_8),  BULK_TABLE(bindata_pam_16) },
+};
+
+static void
+select_bulk (struct pnmreader *const pr)
+{
+	// Called once the header is complete and the region of interest is
+	// clipped to the image:
+	pr->bulk = bulk_table[pr->format][pr->maxval > 255][(pr->got_pixel != NULL) | !full_roi(pr) << 1];
+}
+
+static inline enum pnmreader_result
+consume_last_byte (struct pnmreader *const pr, enum pnmreader_result res)
+{
+	// The bytewise states emit a pixel while the cursor is still on its
+	// last byte. When that finishes the image, step past it, so that the
+	// cursor ends up on the first byte after the image:
+	if (res == PNMREADER_FINISHED) {
+		pr->cur++;
+	}
+	return res;
+}
+
+static enum pnmreader_result
+state_bindata_pbm (struct pnmreader *const pr)
+{
+	enum pnmreader_result res;
+
+	switch (pr->substate)
+	{
+		case 0:	pr->substate = 1;
+			skip_rows_above(pr);
+			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			if (pr->seek > 0) {
+				return after_rows_above(pr);
+			}
+
+		case 1:	return pr->bulk(pr);
+	}
+	// Not reached, placate compiler:
+	__builtin_unreachable();
+}
+
+static enum pnmreader_result
+state_bindata_pgm (struct pnmreader *const pr)
+{
+	enum pnmreader_result res;
+
+	switch (pr->substate)
+	{
+		case 0:	pr->substate = (pr->maxval > 255) ? 2 : 1;
+			skip_rows_above(pr);
+			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			if (pr->seek > 0) {
+				return after_rows_above(pr);
+			}
+			if (pr->substate == 2) {
+				goto state_2;
+			}
+
+		for (;;)
+		{
+		case 1:	// Single-byte PGM:
+			if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			pr->r = *pr->cur;
+			if ((res = emit_pixel(pr, pr->r, pr->r, pr->r)) != PNMREADER_SUCCESS) {
+				return consume_last_byte(pr, res);
+			}
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+		}
+
+		for (;;)
+		{
+state_2:	case 2:	// Double-byte PGM:
+			if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			pr->r = *pr->cur;
+			pr->substate = 3;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 3:	pr->r = ((pr->r << 8) | *pr->cur);
+			if ((res = emit_pixel(pr, pr->r, pr->r, pr->r)) != PNMREADER_SUCCESS) {
+				return consume_last_byte(pr, res);
+			}
+			pr->substate = 2;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+		}
+	}
+	// Not reached, placate compiler:
+	__builtin_unreachable();
+}
+
+static enum pnmreader_result
+state_bindata_ppm (struct pnmreader *const pr)
+{
+	enum pnmreader_result res;
+
+	switch (pr->substate)
+	{
+		case 0:	pr->substate = (pr->maxval > 255) ? 4 : 1;
+			skip_rows_above(pr);
+			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			if (pr->seek > 0) {
+				return after_rows_above(pr);
+			}
+			if (pr->substate == 4) {
+				goto state_4;
+			}
+
+		for (;;)
+		{
+		case 1:	// Single-byte PPM:
+			if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			pr->r = *pr->cur;
+			pr->substate = 2;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 2:	pr->g = *pr->cur;
+			pr->substate = 3;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 3:	if ((res = emit_pixel(pr, pr->r, pr->g, *pr->cur)) != PNMREADER_SUCCESS) {
+				return consume_last_byte(pr, res);
+			}
+			pr->substate = 1;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+		}
+
+		for (;;)
+		{
+state_4:	case 4:	// Double-byte PPM:
+			if ((res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			pr->r = *pr->cur;
+			pr->substate = 5;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 5:	pr->r = ((pr->r << 8) | *pr->cur);
+			pr->substate = 6;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 6:	pr->g = *pr->cur;
+			pr->substate = 7;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 7:	pr->g = ((pr->g << 8) | *pr->cur);
+			pr->substate = 8;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 8:	pr->b = *pr->cur;
+			pr->substate = 9;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 9:	pr->b = ((pr->b << 8) | *pr->cur);
+			if ((res = emit_pixel(pr, pr->r, pr->g, pr->b)) != PNMREADER_SUCCESS) {
+				return consume_last_byte(pr, res);
+			}
+			pr->substate = 4;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+		}
+	}
+	// Not reached, placate compiler:
+	__builtin_unreachable();
+}
+
+static enum pnmreader_result
+state_bindata_pam (struct pnmreader *const pr)
+{
+	enum pnmreader_result res;
+
+	switch (pr->substate)
+	{
+		case 0:	pr->substate = (pr->maxval > 255) ? 2 : 1;
+			skip_rows_above(pr);
+			if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			if (pr->seek > 0) {
+				return after_rows_above(pr);
+			}
+			if (pr->substate == 2) {
+				goto state_2;
+			}
+
+		for (;;)
+		{
+		case 1:	// Single-byte samples, whole tuples in bulk:
+			if (pr->sample == 0 && (res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			if ((res = emit_sample(pr, *pr->cur)) != PNMREADER_SUCCESS) {
+				return consume_last_byte(pr, res);
+			}
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+		}
+
+		for (;;)
+		{
+state_2:	case 2:	// Double-byte samples:
+			if (pr->sample == 0 && (res = pr->bulk(pr)) != PNMREADER_SUCCESS) {
+				return res;
+			}
+			pr->asciinum = *pr->cur;
+			pr->substate = 3;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+
+		case 3:	if ((res = emit_sample(pr, (pr->asciinum << 8) | *pr->cur)) != PNMREADER_SUCCESS) {
+				return consume_last_byte(pr, res);
+			}
+			pr->substate = 2;
+			if (!increment_cur(pr)) {
+				return PNMREADER_FEED_ME;
+			}
+		}
+	}
+	// Not reached, placate compiler:
+	__builtin_unreachable();
+}
+
+static enum pnmreader_result
+state_finished (struct pnmreader *const pr)
+{
+	return PNMREADER_FINISHED;
+}
+
+static void
+reset (struct pnmreader *pr)
+{
+	pr->col = 0;
+	pr->row = 0;
+	pr->charclass = CHAR_WHITESPACE;
+	pr->state = STATE_FORMAT;
+	pr->substate = 0;
+	pr->seek = 0;
+	pr->raster = 0;
+	pr->sample = 0;
+	pr->width = 0;
+	pr->height = 0;
+	pr->maxval = 0;
+	pr->format = FORMAT_UNKNOWN;
+}
+
+static void
+init (
+	struct pnmreader *pr,
+	bool (*got_format) (enum pnm_format, void *userdata),
+	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata),
+	bool (*got_maxval) (unsigned int maxval, void *userdata),
+	bool (*got_pixel) (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata),
+	bool (*got_row) (unsigned int row, const void *samples, void *userdata),
+	void *const userdata
+)
+{
+	pr->cur = NULL;
+	pr->buf = NULL;
+	pr->end = NULL;
+	pr->multi = false;
+	pr->consumed = 0;
+	pr->streampos = 0;
+	reset(pr);
+	STATS(memset(&pr->stats, 0, sizeof(pr->stats));)
+
+	pr->got_format = got_format;
+	pr->got_geometry = got_geometry;
+	pr->got_maxval = got_maxval;
+	pr->got_pixel = got_pixel;
+	pr->got_row = got_row;
+	pr->userdata = userdata;
+
+	pr->rowbuf = NULL;
+	pr->rowbuf_size = 0;
+	pr->channels = 1;
+	pr->dest = NULL;
+	pr->dest_stride = 0;
+	pr->convert = false;
+	pr->scale = NULL;
+	pr->scale_size = 0;
+	pr->pulling = false;
+	pr->roi_x = 0;
+	pr->roi_y = 0;
+	pr->roi_w = UINT_MAX;
+	pr->roi_h = UINT_MAX;
+}
+
+static struct pnmreader *
+create (
+	bool (*got_format) (enum pnm_format, void *userdata),
+	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata),
+	bool (*got_maxval) (unsigned int maxval, void *userdata),
+	bool (*got_pixel) (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata),
+	bool (*got_row) (unsigned int row, const void *samples, void *userdata),
+	void *const userdata
+)
+{
+	struct pnmreader *pr;
+
+	if ((pr = malloc(sizeof(*pr))) == NULL) {
+		return NULL;
+	}
+	init(pr, got_format, got_geometry, got_maxval, got_pixel, got_row, userdata);
+	return pr;
+}
+
+struct pnmreader *
+pnmreader_create (
+	bool (*got_format) (enum pnm_format, void *userdata),
+	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata),
+	bool (*got_maxval) (unsigned int maxval, void *userdata),
+	bool (*got_pixel) (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata),
+	void *const userdata
+)
+{
+	return create(got_format, got_geometry, got_maxval, got_pixel, NULL, userdata);
+}
+
+struct pnmreader *
+pnmreader_create_rows (
+	bool (*got_format) (enum pnm_format, void *userdata),
+	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata),
+	bool (*got_maxval) (unsigned int maxval, void *userdata),
+	bool (*got_row) (unsigned int row, const void *samples, void *userdata),
+	void *const userdata
+)
+{
+	return create(got_format, got_geometry, got_maxval, NULL, got_row, userdata);
+}
+
+void
+pnmreader_destroy (struct pnmreader *pr)
+{
+	if (pr == NULL) {
+		return;
+	}
+	free(pr->rowbuf);
+	free(pr->scale);
+	free(pr);
+}
+
+// Jump table corresponding to the states. Dispatch happens once per call
+// and per state change, not per byte: the raster states hand everything up
+// to the end of the buffer to their bulk loops, which keep the cursor and
+// the end pointer in locals. The fixed cost of a call is therefore a few
+// compares in run() plus one indirect call, and the bytewise substates only
+// handle the pixel or number that straddles two buffers:
+static enum pnmreader_result (*const state_jump_table[])(struct pnmreader *) = {
+	state_separator,
+	state_format,
+	state_pam_header,
+	state_width,
+	state_height,
+	state_maxval,
+	state_ascdata_pbm,
+	state_ascdata_pgm,
+	state_ascdata_ppm,
+	state_bindata_pbm,
+	state_bindata_pgm,
+	state_bindata_ppm,
+	state_bindata_pam,
+	state_finished
+};
+
+// Plain rasters smaller than this per thread are not worth splitting:
+#define PARALLEL_MIN_CHUNK	(1 << 16)
+
+// A chunk of a plain raster, as handled by one worker thread:
+struct worker
+{
+	const struct pnmreader *pr;
+	pthread_t thread;
+	bool started;
+
+	// The chunk, and the end of all data:
+	const unsigned char *start;
+	const unsigned char *end;
+	const unsigned char *limit;
+
+	// First pass: the number of tokens in the chunk, and the invalid
+	// character that cut the count short, if any:
+	size_t ntokens;
+	const unsigned char *invalid;
+
+	// Second pass: the index of the first token in the chunk, and the rows
+	// that start in it. Returns the result and the final cursor position:
+	size_t tokenstart;
+	unsigned int firstrow;
+	unsigned int lastrow;
+	enum pnmreader_result res;
+	const unsigned char *cur;
+
+#if defined(PNMREADER_STATS)
+	// The worker's own counters, added to the reader's when done:
+	struct pnmreader_stats stats;
+#endif
+};
+
+static const unsigned char *
+scan_tokens (const unsigned char *p, const unsigned char *end, bool is_binary, size_t *ntokens)
+{
+	// Scan up to *ntokens tokens: numbers, or single digits in plain PBM.
+	// Whitespace and comments are skipped. Stops after the last token, at
+	// the end of the data or at an invalid character, and returns the
+	// position there. Writes the number of tokens found to *ntokens:
+	size_t n = 0;
+
+	while (n < *ntokens && p < end) {
+		switch (charclass_table[is_binary][*p])
+		{
+			case CHAR_WHITESPACE:
+				p = skip_whitespace(p, end);
+				break;
+
+			case CHAR_COMMENT:
+				p = find_eol(p, end);
+				break;
+
+			case CHAR_NUMERIC:
+				n++;
+				if (is_binary) {
+					p++;
+					break;
+				}
+				while (end - p >= 8) {
+					unsigned int ndigits = count_digits(load_le64(p));
+					p += ndigits;
+					if (ndigits < 8) {
+						break;
+					}
+				}
+				while (p < end && charclass_table[0][*p] == CHAR_NUMERIC) {
+					p++;
+				}
+				break;
+
+			default:
+				*ntokens = n;
+				return p;
+		}
+	}
+	*ntokens = n;
+	return p;
+}
+
+static void *
+count_chunk (void *arg)
+{
+	struct worker *w = arg;
+	const bool is_binary = (w->pr->state == STATE_ASCDATA_PBM);
+	const unsigned char *p;
+
+	w->ntokens = SIZE_MAX;
+	p = scan_tokens(w->start, w->end, is_binary, &w->ntokens);
+	w->invalid = (p < w->end) ? p : NULL;
+	return NULL;
+}
+
+static enum pnmreader_result
+finish_number (struct pnmreader *const pr)
+{
+	// The data ends right after the digits of a number. As the data holds
+	// the complete image, the end of the data terminates the number:
+	enum pnmreader_result res;
+
+	if (pr->state == STATE_ASCDATA_PGM && pr->substate == 1) {
+		res = emit_pixel(pr, pr->asciinum, pr->asciinum, pr->asciinum);
+	}
+	else if (pr->state == STATE_ASCDATA_PPM && pr->substate == 5) {
+		res = emit_pixel(pr, pr->r, pr->g, pr->asciinum);
+	}
+	else {
+		return PNMREADER_FEED_ME;
+	}
+	return (res == PNMREADER_SUCCESS)
+		? PNMREADER_FEED_ME
+		: res;
+}
+
+static void *
+decode_chunk (void *arg)
+{
+	// Decode the worker's rows with a private copy of the reader, which
+	// runs on until the last of them is complete. In a plain raster, the
+	// first row starts at a token somewhere in the chunk:
+	struct worker *w = arg;
+	struct pnmreader r = *w->pr;
+
+	STATS(memset(&r.stats, 0, sizeof(r.stats)); w->stats = r.stats;)
+
+	if (w->firstrow >= w->lastrow) {
+		w->res = PNMREADER_FINISHED;
+		w->cur = w->start;
+		return NULL;
+	}
+	if (r.state <= STATE_ASCDATA_PPM) {
+		size_t skip = (size_t)w->firstrow * r.width * r.channels - w->tokenstart;
+
+		r.buf = (unsigned char *)scan_tokens(w->start, w->end, r.state == STATE_ASCDATA_PBM, &skip);
+		r.charclass = CHAR_WHITESPACE;
+		r.substate = 0;
+	}
+	else {
+		r.buf = (unsigned char *)w->start;
+	}
+	r.cur = r.buf;
+	r.end = (unsigned char *)w->limit;
+	r.col = 0;
+	r.row = w->firstrow;
+	r.height = w->lastrow;
+	r.multi = false;
+	r.rowbuf = NULL;
+	r.rowbuf_size = 0;
+
+	if (wants_rows(&r) && alloc_rowbuf(&r) == false) {
+		w->res = PNMREADER_UNSUPPORTED;
+		w->cur = r.cur;
+		return NULL;
+	}
+	while ((w->res = state_jump_table[r.state](&r)) == PNMREADER_SUCCESS) {
+		if (r.cur == r.end) {
+			w->res = PNMREADER_FEED_ME;
+			break;
+		}
+	}
+	if (w->res == PNMREADER_FEED_ME) {
+		w->res = finish_number(&r);
+	}
+	w->cur = r.cur;
+	STATS(w->stats = r.stats;)
+	free(r.rowbuf);
+	return NULL;
+}
+
+#if defined(PNMREADER_STATS)
+static void
+add_worker_stats (struct pnmreader_stats *const dst, const struct pnmreader_stats *const src)
+{
+	// Workers only count callbacks, their bytes are counted by run().
+	// Callback times are summed over all threads:
+	dst->header_callbacks += src->header_callbacks;
+	dst->pixel_callbacks += src->pixel_callbacks;
+	dst->row_callbacks += src->row_callbacks;
+	dst->ns_callbacks += src->ns_callbacks;
+}
+#endif
+
+static void
+run_workers (struct worker *w, size_t nworkers, void *(*fn) (void *))
+{
+	// Run the function on all workers, the first one on this thread. If a
+	// thread cannot be started, do its work here instead:
+	for (size_t i = 1; i < nworkers; i++) {
+		w[i].started = (pthread_create(&w[i].thread, NULL, fn, &w[i]) == 0);
+	}
+	fn(&w[0]);
+
+	for (size_t i = 1; i < nworkers; i++) {
+		if (w[i].started) {
+			pthread_join(w[i].thread, NULL);
+		}
+		else {
+			fn(&w[i]);
+		}
+	}
+}
+
+static enum pnmreader_result
+decode_workers (struct pnmreader *const pr, struct worker *w, size_t nworkers, enum pnmreader_result res, const unsigned char *errpos, unsigned int nrows)
+{
+	// Decode the first nrows rows on the workers, and combine the results.
+	// An error is reported where the sequential decoder would have run
+	// into it first. Start with the error found beforehand, if any:
+	struct worker *last = NULL;
+
+	run_workers(w, nworkers, decode_chunk);
+
+	for (size_t i = 0; i < nworkers; i++) {
+		STATS(add_worker_stats(&pr->stats, &w[i].stats);)
+		if (w[i].firstrow < w[i].lastrow) {
+			last = &w[i];
+		}
+		if (w[i].res == PNMREADER_FINISHED || w[i].res == PNMREADER_FEED_ME) {
+			continue;
+		}
+		if (errpos == NULL || w[i].cur < errpos) {
+			res = w[i].res;
+			errpos = w[i].cur;
+		}
+	}
+	if (errpos != NULL) {
+		pr->cur = (unsigned char *)errpos;
+		return res;
+	}
+	if (last != NULL && last->res == PNMREADER_FEED_ME) {
+		pr->cur = pr->end;
+		return PNMREADER_FEED_ME;
+	}
+	// The image is finished if the workers decoded all rows:
+	if (nrows == pr->height) {
+		pr->cur = (unsigned char *)last->cur;
+		pr->col = 0;
+		pr->row = pr->height;
+		pr->state = STATE_FINISHED;
+		return PNMREADER_FINISHED;
+	}
+	// Otherwise the data ends inside the raster. Continue after the last
+	// complete row, where the sequential decoder would be, and decode the
+	// partial row that follows with it, so that the rest of the image can
+	// be fed with pnmreader_feed(). A plain row ends right after its last
+	// number, so the lexer starts on the whitespace that follows:
+	if (last != NULL) {
+		pr->cur = (unsigned char *)last->cur;
+		pr->col = 0;
+		pr->row = nrows;
+		pr->charclass = CHAR_WHITESPACE;
+	}
+	return (pr->cur < pr->end)
+		? state_jump_table[pr->state](pr)
+		: PNMREADER_FEED_ME;
+}
+
+static enum pnmreader_result
+ascdata_parallel (struct pnmreader *const pr, unsigned int nthreads)
+{
+	// Decode a complete plain raster in two passes over chunks that end
+	// on line boundaries. Comments end at the end of the line, so no chunk
+	// starts inside one, or inside a number. The first pass counts the
+	// tokens in every chunk. A prefix sum of the counts then tells which
+	// rows start in each chunk, and the second pass decodes them:
+	const bool is_binary = (pr->state == STATE_ASCDATA_PBM);
+	const unsigned char *start = pr->cur;
+	const unsigned char *end = pr->end;
+	const size_t rowtokens = (size_t)pr->width * pr->channels;
+	const size_t needed = (rowtokens > SIZE_MAX / pr->height) ? SIZE_MAX : rowtokens * pr->height;
+	struct worker single;
+	struct worker *w = &single;
+	const unsigned char *invalid = NULL;
+	const unsigned char *errpos = NULL;
+	enum pnmreader_result res = PNMREADER_SUCCESS;
+	size_t nworkers = (size_t)(end - start) / PARALLEL_MIN_CHUNK;
+	size_t total = 0;
+	unsigned int nrows;
+
+	// Skip the rest of a comment that ends the header:
+	if (pr->charclass == CHAR_COMMENT) {
+		start = find_eol(start, end);
+	}
+	if (nworkers > nthreads) {
+		nworkers = nthreads;
+	}
+	if (nworkers < 2 || (w = malloc(nworkers * sizeof(*w))) == NULL) {
+		w = &single;
+		nworkers = 1;
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		const unsigned char *p = start + (size_t)(end - start) / nworkers * i;
+
+		// Move the split point past the next end-of-line:
+		if (i > 0) {
+			if (p < w[i - 1].start) {
+				p = w[i - 1].start;
+			}
+			if ((p = find_eol(p, end)) < end) {
+				p++;
+			}
+			w[i - 1].end = p;
+		}
+		w[i].pr = pr;
+		w[i].start = p;
+		w[i].end = end;
+		w[i].limit = end;
+	}
+	// Count even for a single worker, to know whether the data holds the
+	// whole raster:
+	run_workers(w, nworkers, count_chunk);
+
+	// Prefix sum of the token counts. Counting stops at the first invalid
+	// character, which is an error if the sequential decoder would reach
+	// it: if it comes before the last token needed, or is glued to it:
+	for (size_t i = 0; i < nworkers; i++) {
+		w[i].tokenstart = total;
+
+		// Chunks after the first invalid character do not count:
+		if (invalid != NULL) {
+			w[i].ntokens = 0;
+			continue;
+		}
+		total += w[i].ntokens;
+		if ((invalid = w[i].invalid) == NULL) {
+			continue;
+		}
+		if (total < needed || (total == needed && !is_binary
+		 && invalid > w[i].start && charclass_table[0][invalid[-1]] == CHAR_NUMERIC)) {
+			res = PNMREADER_INVALID_CHAR;
+			errpos = invalid;
+		}
+	}
+	// Decode the rows that start before the first invalid character. If
+	// the data ends inside the raster, decode only the complete rows, and
+	// leave the rest to the sequential decoder. A number at the very end
+	// of the data may continue in the next buffer, so it is not complete:
+	if (total >= needed) {
+		nrows = pr->height;
+	}
+	else if (errpos != NULL) {
+		nrows = (total + rowtokens - 1) / rowtokens;
+	}
+	else {
+		size_t done = total;
+
+		if (done > 0 && !is_binary && charclass_table[0][end[-1]] == CHAR_NUMERIC) {
+			done--;
+		}
+		nrows = done / rowtokens;
+	}
+
+	for (size_t i = 0; i < nworkers; i++) {
+		size_t first = (w[i].tokenstart + rowtokens - 1) / rowtokens;
+		size_t next = (i + 1 < nworkers) ? (w[i].tokenstart + w[i].ntokens + rowtokens - 1) / rowtokens : nrows;
+
+		w[i].firstrow = (first < nrows) ? first : nrows;
+		w[i].lastrow = (next < nrows) ? next : nrows;
+	}
+	res = decode_workers(pr, w, nworkers, res, errpos, nrows);
+
+	if (w != &single) {
+		free(w);
+	}
+	return res;
+}
+
+static enum pnmreader_result
+bindata_parallel (struct pnmreader *const pr, unsigned int nthreads)
+{
+	// In a binary raster, every row starts at a known offset, so the rows
+	// can be divided among the workers right away:
+	const size_t samplesize = (pr->maxval > 255) ? 2 : 1;
+	struct worker single;
+	struct worker *w = &single;
+	enum pnmreader_result res;
+	size_t rowsize;
+	size_t nworkers;
+	size_t avail;
+	unsigned int nrows;
+
+	// Skip the single whitespace character that ends the header, and set
+	// the substate that the bytewise states would continue in:
+	switch (pr->state)
+	{
+		case STATE_BINDATA_PBM: pr->substate = 1; break;
+		case STATE_BINDATA_PGM: pr->substate = (samplesize == 2) ? 2 : 1; break;
+		case STATE_BINDATA_PAM: pr->substate = (samplesize == 2) ? 2 : 1; break;
+		default:                pr->substate = (samplesize == 2) ? 4 : 1; break;
+	}
+	if ((res = skip_single_whitespace(pr)) != PNMREADER_SUCCESS) {
+		return res;
+	}
+	if (pr->state == STATE_BINDATA_PBM) {
+		rowsize = ((size_t)pr->width + 7) / 8;
+	}
+	else if (pr->width <= SIZE_MAX / pr->channels / samplesize) {
+		rowsize = (size_t)pr->width * pr->channels * samplesize;
+	}
+	else {
+		return PNMREADER_UNSUPPORTED;
+	}
+	// Decode the complete rows; a partial row at the end of the data is
+	// left to the sequential decoder:
+	avail = (size_t)(pr->end - pr->cur);
+	nrows = (avail / rowsize < pr->height) ? avail / rowsize : pr->height;
+
+	if ((nworkers = avail / PARALLEL_MIN_CHUNK) > nthreads) {
+		nworkers = nthreads;
+	}
+	if (nworkers > nrows) {
+		nworkers = nrows;
+	}
+	if (nworkers < 2 || (w = malloc(nworkers * sizeof(*w))) == NULL) {
+		w = &single;
+		nworkers = 1;
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		w[i].pr = pr;
+		w[i].firstrow = (uint64_t)nrows * i / nworkers;
+		w[i].lastrow = (uint64_t)nrows * (i + 1) / nworkers;
+		w[i].start = pr->cur + w[i].firstrow * rowsize;
+		w[i].end = pr->end;
+		w[i].limit = w[i].end;
+	}
+	res = decode_workers(pr, w, nworkers, PNMREADER_SUCCESS, NULL, nrows);
+
+	if (w != &single) {
+		free(w);
+	}
+	return res;
+}
+
+#if defined(PNMREADER_STATS)
+static void
+count_bytes (struct pnmreader *const pr, enum state state, uint64_t nbytes)
+{
+	if (state <= STATE_MAXVAL) {
+		pr->stats.bytes_header += nbytes;
+	}
+	else if (state <= STATE_ASCDATA_PPM) {
+		pr->stats.bytes_plain += nbytes;
+	}
+	else {
+		pr->stats.bytes_binary += nbytes;
+	}
+}
+
+static void
+count_suspension (struct pnmreader *const pr)
+{
+	// The data ran out inside a number of the header or of a plain
+	// raster, or inside a binary pixel. The cursor is at the end of the
+	// buffer, whose stream offset is in streampos:
+	if (pr->seek > 0 || pr->state == STATE_FINISHED) {
+		return;
+	}
+	if (pr->state <= STATE_ASCDATA_PPM) {
+		if (pr->charclass == CHAR_NUMERIC) {
+			pr->stats.split_tokens++;
+		}
+		return;
+	}
+	if (pr->state != STATE_BINDATA_PBM) {
+		uint64_t pixelsize = (uint64_t)pr->channels * ((pr->maxval > 255) ? 2 : 1);
+		uint64_t offset = pr->streampos + (uint64_t)(pr->cur - pr->buf) - pr->raster;
+
+		if (offset % pixelsize != 0) {
+			pr->stats.split_pixels++;
+		}
+	}
+}
+#endif
+
+static enum pnmreader_result
+run_states (struct pnmreader *pr, unsigned int nthreads)
+{
+	for (;;)
+	{
+		// Skip data up to the row that was sought, or past rows outside
+		// the region of interest:
+		if (pr->seek > 0) {
+			size_t avail = pr->end - pr->cur;
+			size_t skip = (pr->seek < avail) ? pr->seek : avail;
+
+			STATS(pr->stats.bytes_skipped += skip;)
+			pr->cur += skip;
+			pr->seek -= skip;
+			if (pr->seek > 0) {
 				return PNMREADER_FEED_ME;
 			}
+		}
+		// In multi-image mode, start on the next image right away. A
+		// batch of pulled rows ends with the image, though:
+		if (pr->state == STATE_FINISHED && pr->multi) {
+			if (pr->pulling && pr->pull_rows > 0) {
+				return PNMREADER_FINISHED;
+			}
+			reset(pr);
+			pr->state = STATE_SEPARATOR;
+		}
+		// Without data, there is nothing to do:
+		if (pr->cur == pr->end) {
+			return (pr->state == STATE_SEPARATOR)
+				? state_separator(pr)
+				: (pr->state == STATE_FINISHED)
+				? PNMREADER_FINISHED
+				: PNMREADER_FEED_ME;
+		}
+		// Execute handler for current state. In parallel mode, rasters
+		// are decoded as a whole, unless only a region is wanted:
+		STATS(const unsigned char *from = pr->cur; enum state state = pr->state;)
+		enum pnmreader_result res = (nthreads == 0
+			|| pr->state < STATE_ASCDATA_PBM
+			|| pr->state > STATE_BINDATA_PAM
+			|| pr->substate != 0 || pr->row != 0 || pr->col != 0
+			|| !full_roi(pr))
+			? state_jump_table[pr->state](pr)
+			: (pr->state <= STATE_ASCDATA_PPM)
+			? ascdata_parallel(pr, nthreads)
+			: bindata_parallel(pr, nthreads);
+
+		STATS(count_bytes(pr, state, pr->cur - from);)
+
+		// On success, continue to next state:
+		if (res == PNMREADER_SUCCESS) {
+			continue;
+		}
+		// A finished image may still have rows to skip, and in
+		// multi-image mode the next image follows:
+		if (res == PNMREADER_FINISHED && pr->state == STATE_FINISHED && (pr->multi || pr->seek > 0)) {
+			continue;
+		}
+		// Other status codes are passed on to caller:
+		return res;
+	}
+}
+
+static enum pnmreader_result
+run (struct pnmreader *pr, unsigned int nthreads)
+{
+#if defined(PNMREADER_STATS)
+	// Time the call, and count where it ran out of data:
+	uint64_t start = stats_clock();
+	enum pnmreader_result res = run_states(pr, nthreads);
+
+	pr->stats.feeds++;
+	pr->stats.ns_decoder += stats_clock() - start;
+	if (res == PNMREADER_FEED_ME) {
+		count_suspension(pr);
+	}
+	return res;
+#else
+	return run_states(pr, nthreads);
+#endif
+}
+
+enum pnmreader_result
+pnmreader_feed (struct pnmreader *pr, char *const data, size_t nbytes)
+{
+	enum pnmreader_result res;
+
+	if (pr == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	pr->buf = (unsigned char *)data;
+	pr->cur = (unsigned char *)data;
+	pr->end = pr->buf + nbytes;
+
+	res = run(pr, 0);
+	pr->consumed = pr->cur - pr->buf;
+	pr->streampos += pr->consumed;
+	return res;
+}
+
+enum pnmreader_result
+pnmreader_feed_parallel (struct pnmreader *pr, char *const data, size_t nbytes, unsigned int nthreads)
+{
+	enum pnmreader_result res;
+
+	if (pr == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	pr->buf = (unsigned char *)data;
+	pr->cur = (unsigned char *)data;
+	pr->end = pr->buf + nbytes;
+
+	res = run(pr, (nthreads > 0) ? nthreads : 1);
+	pr->consumed = pr->cur - pr->buf;
+	pr->streampos += pr->consumed;
+	return res;
+}
+
+void
+pnmreader_set_input (struct pnmreader *pr, char *const data, size_t nbytes)
+{
+	if (pr == NULL) {
+		return;
+	}
+	pr->buf = (unsigned char *)data;
+	pr->cur = (unsigned char *)data;
+	pr->end = pr->buf + nbytes;
+	pr->consumed = 0;
+}
+
+enum pnmreader_result
+pnmreader_next_rows (struct pnmreader *pr, void *dst, size_t stride, unsigned int max_rows, unsigned int *nrows)
+{
+	enum pnmreader_result res;
+
+	if (pr == NULL || nrows == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	*nrows = 0;
+
+	// Rows are stored in one place only:
+	if (pr->dest != NULL) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	if (max_rows == 0) {
+		return PNMREADER_SUCCESS;
+	}
+	pr->pulling = true;
+	pr->pull = dst;
+	pr->pull_stride = stride;
+	pr->pull_rows = 0;
+	pr->pull_max = max_rows;
+
+	// If the header is already done, check the stride against it:
+	if (pr->state >= STATE_ASCDATA_PBM && pr->state <= STATE_BINDATA_PAM && alloc_rowbuf(pr) == false) {
+		pr->pulling = false;
+		return PNMREADER_UNSUPPORTED;
+	}
+	// Decode from the cursor on. The stream offset is that of the
+	// cursor between calls, but that of the buffer within run():
+	pr->streampos -= (uint64_t)(pr->cur - pr->buf);
+	res = run(pr, 0);
+	pr->consumed = pr->cur - pr->buf;
+	pr->streampos += pr->consumed;
+	pr->pulling = false;
+
+	*nrows = pr->pull_rows;
+	return (res == PNMREADER_PAUSED) ? PNMREADER_SUCCESS : res;
+}
 
-		case 5:	pr->r = ((pr->r << 8) | *pr->cur);
-			pr->substate = 6;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
-			}
+size_t
+pnmreader_get_consumed (struct pnmreader *pr)
+{
+	return (pr == NULL) ? 0 : pr->consumed;
+}
 
-		case 6:	pr->g = *pr->cur;
-			pr->substate = 7;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
-			}
+bool
+pnmreader_get_stats (struct pnmreader *pr, struct pnmreader_stats *stats)
+{
+#if defined(PNMREADER_STATS)
+	if (pr == NULL || stats == NULL) {
+		return false;
+	}
+	// The decoder time is kept as a total, which includes the callbacks.
+	// With threads, these can add up to more than the total:
+	*stats = pr->stats;
+	stats->ns_decoder -= (stats->ns_callbacks < stats->ns_decoder) ? stats->ns_callbacks : stats->ns_decoder;
+	return true;
+#else
+	return false;
+#endif
+}
 
-		case 7:	pr->g = ((pr->g << 8) | *pr->cur);
-			pr->substate = 8;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
-			}
+void
+pnmreader_reset (struct pnmreader *pr)
+{
+	if (pr == NULL) {
+		return;
+	}
+	reset(pr);
 
-		case 8:	pr->b = *pr->cur;
-			pr->substate = 9;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
-			}
+	// Allow whitespace and comments before the next image, such as the
+	// newline that often ends a plain image:
+	pr->state = STATE_SEPARATOR;
+}
 
-		case 9:	pr->b = ((pr->b << 8) | *pr->cur);
-			if ((res = emit_pixel(pr, pr->r, pr->g, pr->b)) != PNMREADER_SUCCESS) {
-				return res;
-			}
-			pr->substate = 4;
-			if (!increment_cur(pr)) {
-				return PNMREADER_FEED_ME;
-			}
-		}
+void
+pnmreader_set_multi (struct pnmreader *pr, bool multi)
+{
+	if (pr == NULL) {
+		return;
 	}
-	// Not reached, placate compiler:
-	__builtin_unreachable();
+	pr->multi = multi;
 }
 
-static enum pnmreader_result
-state_finished (struct pnmreader *const pr)
+static bool
+row_offset (struct pnmreader *pr, unsigned int row, uint64_t *offset)
 {
-	return PNMREADER_FINISHED;
+	// Only binary rasters have rows at fixed offsets:
+	if (pr->state <= STATE_MAXVAL || pr->format < FORMAT_PBM_BIN || row >= pr->height) {
+		return false;
+	}
+	*offset = pr->raster + raster_rowsize(pr) * row;
+	return true;
 }
 
-struct pnmreader *
-pnmreader_create (
-	bool (*got_format) (enum pnm_format, void *userdata),
-	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata),
-	bool (*got_maxval) (unsigned int maxval, void *userdata),
-	bool (*got_pixel) (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata),
-	void *const userdata
-)
+static void
+goto_row (struct pnmreader *pr, unsigned int row)
 {
-	struct pnmreader *pr;
-
-	if ((pr = malloc(sizeof(*pr))) == NULL) {
-		return NULL;
+	// Resume decoding in the state for the first byte of the row:
+	switch (pr->format)
+	{
+		case FORMAT_PBM_BIN:
+			pr->state = STATE_BINDATA_PBM;
+			pr->substate = 1;
+			break;
+
+		case FORMAT_PGM_BIN:
+			pr->state = STATE_BINDATA_PGM;
+			pr->substate = (pr->maxval > 255) ? 2 : 1;
+			break;
+
+		case FORMAT_PAM:
+			pr->state = STATE_BINDATA_PAM;
+			pr->substate = (pr->maxval > 255) ? 2 : 1;
+			break;
+
+		default:
+			pr->state = STATE_BINDATA_PPM;
+			pr->substate = (pr->maxval > 255) ? 4 : 1;
+			break;
 	}
-	pr->cur = NULL;
-	pr->buf = NULL;
-	pr->bufsize = 0;
+	pr->row = row;
 	pr->col = 0;
-	pr->row = 0;
-	pr->charclass = CHAR_WHITESPACE;
-	pr->state = STATE_FORMAT;
-	pr->substate = 0;
+	pr->sample = 0;
+}
+
+bool
+pnmreader_row_offset (struct pnmreader *pr, unsigned int row, uint64_t *offset)
+{
+	if (pr == NULL) {
+		return false;
+	}
+	if (offset == NULL) {
+		return false;
+	}
+	return row_offset(pr, row, offset);
+}
+
+bool
+pnmreader_seek_row (struct pnmreader *pr, unsigned int row)
+{
+	uint64_t offset;
+
+	if (pr == NULL) {
+		return false;
+	}
+	if (row_offset(pr, row, &offset) == false) {
+		return false;
+	}
+	// Rows outside the region of interest are never decoded:
+	if (row < pr->y0 || row >= pr->y1) {
+		return false;
+	}
+	// The caller continues feeding data from the offset of the row:
+	goto_row(pr, row);
+	pr->streampos = offset;
 	pr->seek = 0;
-	pr->width = 0;
-	pr->height = 0;
+	return true;
+}
 
-	pr->got_format = got_format;
-	pr->got_geometry = got_geometry;
-	pr->got_maxval = got_maxval;
-	pr->got_pixel = got_pixel;
-	pr->userdata = userdata;
+bool
+pnmreader_skip_to_row (struct pnmreader *pr, unsigned int row)
+{
+	uint64_t offset;
 
-	return pr;
+	if (pr == NULL) {
+		return false;
+	}
+	if (row_offset(pr, row, &offset) == false) {
+		return false;
+	}
+	// Rows outside the region of interest are never decoded:
+	if (row < pr->y0 || row >= pr->y1) {
+		return false;
+	}
+	// Data is only skipped in the forward direction:
+	if (offset < pr->streampos) {
+		return false;
+	}
+	goto_row(pr, row);
+	pr->seek = offset - pr->streampos;
+	return true;
 }
 
 void
-pnmreader_destroy (struct pnmreader *pr)
+pnmreader_set_dest (struct pnmreader *pr, void *dest, size_t stride)
 {
-	free(pr);
+	if (pr == NULL) {
+		return;
+	}
+	pr->dest = dest;
+	pr->dest_stride = stride;
+	pr->convert = false;
 }
 
-enum pnmreader_result
-pnmreader_feed (struct pnmreader *pr, char *const data, size_t nbytes)
+void
+pnmreader_decode_into (struct pnmreader *pr, void *dest, size_t stride, unsigned int layout)
 {
-	// Jump table corresponding to the states:
-	enum pnmreader_result (*state_jump_table[])(struct pnmreader *) = {
-		state_format,
-		state_width,
-		state_height,
-		state_maxval,
-		state_ascdata_pbm,
-		state_ascdata_pgm,
-		state_ascdata_ppm,
-		state_bindata_pbm,
-		state_bindata_pgm,
-		state_bindata_ppm,
-		state_finished
-	};
 	if (pr == NULL) {
-		return PNMREADER_ABORTED;
+		return;
 	}
-	pr->buf = (unsigned char *)data;
-	pr->cur = (unsigned char *)data;
-	pr->bufsize = nbytes;
-
-	for (;;)
-	{
-		// Execute handler for current state:
-		enum pnmreader_result res = state_jump_table[pr->state](pr);
+	pr->dest = dest;
+	pr->dest_stride = stride;
+	pr->convert = (dest != NULL);
+	pr->layout = layout;
+}
 
-		// On success, continue to next state:
-		if (res == PNMREADER_SUCCESS) {
-			continue;
-		}
-		// Other status codes are passed on to caller:
-		return res;
+bool
+pnmreader_set_roi (struct pnmreader *pr, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+	if (pr == NULL) {
+		return false;
+	}
+	if (width == 0 || height == 0) {
+		return false;
 	}
+	pr->roi_x = x;
+	pr->roi_y = y;
+	pr->roi_w = width;
+	pr->roi_h = height;
+	return true;
 }
 
 bool
@@ -710,7 +3013,7 @@ pnmreader_get_format (struct pnmreader *pr, enum pnm_format *format)
 	if (format == NULL) {
 		return false;
 	}
-	if (pr->state < STATE_WIDTH) {
+	if (pr->state <= STATE_FORMAT) {
 		return false;
 	}
 	*format = pr->format;
@@ -752,3 +3055,258 @@ pnmreader_get_maxval (struct pnmreader *pr, unsigned int *maxval)
 	*maxval = pr->maxval;
 	return true;
 }
+
+bool
+pnmreader_get_depth (struct pnmreader *pr, unsigned int *depth)
+{
+	if (pr == NULL) {
+		return false;
+	}
+	if (depth == NULL) {
+		return false;
+	}
+	if (pr->state <= STATE_PAM_HEADER) {
+		return false;
+	}
+	*depth = pr->channels;
+	return true;
+}
+
+bool
+pnmreader_get_tupltype (struct pnmreader *pr, const char **tupltype)
+{
+	if (pr == NULL) {
+		return false;
+	}
+	if (tupltype == NULL) {
+		return false;
+	}
+	if (pr->state <= STATE_PAM_HEADER || pr->format != FORMAT_PAM) {
+		return false;
+	}
+	*tupltype = pr->tupltype;
+	return true;
+}
+
+static bool
+map_got_format (enum pnm_format format, void *userdata)
+{
+	// Only the binary formats have a raster that can be used in place:
+	return (format == FORMAT_PBM_BIN
+	     || format == FORMAT_PGM_BIN
+	     || format == FORMAT_PPM_BIN
+	     || format == FORMAT_PAM);
+}
+
+static bool
+header_got_maxval (unsigned int maxval, void *userdata)
+{
+	// Stop right after the header:
+	return false;
+}
+
+enum pnmreader_result
+pnmreader_map_fd (int fd, struct pnmreader_map *map)
+{
+	struct pnmreader pr;
+	struct stat st;
+	enum pnmreader_result res;
+	const unsigned char *end;
+	size_t rowsize;
+	off_t offset;
+	off_t pagesize;
+
+	if (map == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	map->mapping = NULL;
+	map->mapsize = 0;
+
+	// Only regular files can be mapped. Check this before touching the
+	// file, so that the caller can still stream from pipes and sockets:
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	// Start at the current file offset, like a read would. The mapping
+	// itself must start at a page boundary:
+	if ((offset = lseek(fd, 0, SEEK_CUR)) < 0 || offset >= st.st_size) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	if ((pagesize = sysconf(_SC_PAGESIZE)) <= 0) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	if ((uintmax_t)(st.st_size - offset) > SIZE_MAX - pagesize) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	map->mapsize = st.st_size - offset + offset % pagesize;
+	if ((map->mapping = mmap(NULL, map->mapsize, PROT_READ, MAP_PRIVATE, fd, offset - offset % pagesize)) == MAP_FAILED) {
+		map->mapping = NULL;
+		map->mapsize = 0;
+		return PNMREADER_UNSUPPORTED;
+	}
+	map->data = (char *)map->mapping + offset % pagesize;
+	map->size = st.st_size - offset;
+	end = (const unsigned char *)map->data + map->size;
+
+	// Parse the header with a reader that stops after the maxval:
+	init(&pr, map_got_format, NULL, header_got_maxval, NULL, NULL, NULL);
+	res = pnmreader_feed(&pr, map->data, map->size);
+
+	switch (res) {
+		case PNMREADER_ABORTED:
+			// Aborted by one of our own callbacks:
+			if (pr.state > STATE_FORMAT) {
+				break;
+			}
+			res = PNMREADER_UNSUPPORTED;
+
+		default:
+			pnmreader_unmap(map);
+			return res;
+	}
+	// The raster starts after the single whitespace character that ends
+	// the header:
+	if (pr.cur == end) {
+		pnmreader_unmap(map);
+		return PNMREADER_FEED_ME;
+	}
+	if (pr.charclass != CHAR_WHITESPACE) {
+		pnmreader_unmap(map);
+		return PNMREADER_INVALID_CHAR;
+	}
+	rowsize = (pr.format == FORMAT_PBM_BIN)
+		? ((size_t)pr.width + 7) / 8
+		: (size_t)pr.width * pr.channels * ((pr.maxval > 255) ? 2 : 1);
+
+	map->format = pr.format;
+	map->width = pr.width;
+	map->height = pr.height;
+	map->maxval = pr.maxval;
+	map->depth = pr.channels;
+	map->raster = pr.cur + 1;
+	map->stride = rowsize;
+
+	// The file must hold the complete raster:
+	if ((size_t)(end - map->raster) / rowsize < pr.height) {
+		pnmreader_unmap(map);
+		return PNMREADER_FEED_ME;
+	}
+	return PNMREADER_SUCCESS;
+}
+
+enum pnmreader_result
+pnmreader_map_file (const char *path, struct pnmreader_map *map)
+{
+	enum pnmreader_result res;
+	int fd;
+
+	if (path == NULL || map == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		map->mapping = NULL;
+		map->mapsize = 0;
+		return PNMREADER_UNSUPPORTED;
+	}
+	// The mapping stays valid after the file is closed:
+	res = pnmreader_map_fd(fd, map);
+	close(fd);
+	return res;
+}
+
+void
+pnmreader_unmap (struct pnmreader_map *map)
+{
+	if (map == NULL || map->mapping == NULL) {
+		return;
+	}
+	munmap(map->mapping, map->mapsize);
+	map->mapping = NULL;
+	map->mapsize = 0;
+}
+
+enum pnmreader_result
+pnmreader_probe_fd (int fd, struct pnmreader_probe *probe)
+{
+	// Most headers fit in a single read of this size:
+	unsigned char buf[256];
+	struct pnmreader pr;
+	struct stat st;
+	enum pnmreader_result res = PNMREADER_FEED_ME;
+	off_t start = 0;
+	bool seekable;
+
+	if (probe == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	if (fstat(fd, &st) < 0) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	// Regular files are read with pread(), which leaves the file offset
+	// alone. Other files are read a byte at a time, so that nothing past
+	// the header is consumed:
+	seekable = S_ISREG(st.st_mode) && (start = lseek(fd, 0, SEEK_CUR)) >= 0;
+
+	// Parse the header with a reader that stops after the maxval. Without
+	// a row callback, the reader does not allocate:
+	init(&pr, NULL, NULL, header_got_maxval, NULL, NULL, NULL);
+	while (res == PNMREADER_FEED_ME) {
+		ssize_t nread = (seekable)
+			? pread(fd, buf, sizeof(buf), start + (off_t)pr.streampos)
+			: read(fd, buf, 1);
+
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return PNMREADER_UNSUPPORTED;
+		}
+		if (nread == 0) {
+			return PNMREADER_FEED_ME;
+		}
+		res = pnmreader_feed(&pr, (char *)buf, nread);
+	}
+	if (res != PNMREADER_ABORTED) {
+		return res;
+	}
+	// The reader stopped on the whitespace character that ends the
+	// header, which must be a single whitespace in the binary formats:
+	if (pr.format >= FORMAT_PBM_BIN && pr.charclass != CHAR_WHITESPACE) {
+		return PNMREADER_INVALID_CHAR;
+	}
+	probe->format = pr.format;
+	probe->width = pr.width;
+	probe->height = pr.height;
+	probe->maxval = pr.maxval;
+	probe->depth = pr.channels;
+	probe->header_size = pr.streampos + 1;
+	probe->raster_size = 0;
+
+	if (pr.format < FORMAT_PBM_BIN) {
+		return PNMREADER_SUCCESS;
+	}
+	probe->raster_size = raster_rowsize(&pr) * pr.height;
+
+	// A regular file must hold the complete raster:
+	if (seekable && (uint64_t)(st.st_size - start) - probe->header_size < probe->raster_size) {
+		return PNMREADER_FEED_ME;
+	}
+	return PNMREADER_SUCCESS;
+}
+
+enum pnmreader_result
+pnmreader_probe_file (const char *path, struct pnmreader_probe *probe)
+{
+	enum pnmreader_result res;
+	int fd;
+
+	if (path == NULL || probe == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return PNMREADER_UNSUPPORTED;
+	}
+	res = pnmreader_probe_fd(fd, probe);
+	close(fd);
+	return res;
+}
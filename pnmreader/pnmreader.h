@@ -1,6 +1,8 @@
 #ifndef PNMREADER_H
 #define PNMREADER_H
 
+#include <stdint.h>
+
 // The main structure, kept private:
 struct pnmreader;
 
@@ -25,7 +27,8 @@ enum pnm_format
 	FORMAT_PPM_ASC,
 	FORMAT_PBM_BIN,
 	FORMAT_PGM_BIN,
-	FORMAT_PPM_BIN
+	FORMAT_PPM_BIN,
+	FORMAT_PAM
 };
 #endif
 
@@ -43,13 +46,42 @@ pnmreader_create
 	bool (*got_maxval) (unsigned int maxval, void *userdata),
 
 	// Called when a pixel has been read. If the image format is grayscale or
-	// monochrome, r, g, and b will all have the same value. Skipped when NULL.
+	// monochrome, r, g, and b will all have the same value. For PAM images,
+	// r, g and b are the first three samples of a tuple; with fewer than
+	// three samples, they all have the value of the first one. Other samples,
+	// such as alpha, are only available from the row interface. Skipped when
+	// NULL.
 	bool (*got_pixel) (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata),
 
 	// The user-supplied pointer to return to the user during a callback:
 	void *const userdata
 );
 
+// Create a new pnmreader struct that returns whole rows instead of pixels.
+struct pnmreader *
+pnmreader_create_rows
+(
+	// Called when the PNM format header has been decoded. Skipped when NULL.
+	bool (*got_format) (enum pnm_format, void *userdata),
+
+	// Called when the width and height have been decoded. Skipped when NULL.
+	bool (*got_geometry) (unsigned int width, unsigned int height, void *userdata),
+
+	// Called when the PNM max value has been determined. Skipped when NULL.
+	bool (*got_maxval) (unsigned int maxval, void *userdata),
+
+	// Called when a complete row has been read. The samples are interleaved:
+	// one sample per pixel for monochrome and grayscale images, three (r, g,
+	// b) for color images, and as many as the depth for PAM images. Samples
+	// are uint8_t when maxval is at most 255, else uint16_t in native byte
+	// order. The buffer is only valid for the duration of the callback.
+	// Skipped when NULL.
+	bool (*got_row) (unsigned int row, const void *samples, void *userdata),
+
+	// The user-supplied pointer to return to the user during a callback:
+	void *const userdata
+);
+
 // Destroy the pnmreader struct:
 void pnmreader_destroy (struct pnmreader *);
 
@@ -59,6 +91,218 @@ void pnmreader_destroy (struct pnmreader *);
 enum pnmreader_result
 pnmreader_feed (struct pnmreader *, char *const data, size_t nbytes);
 
+// Push a buffer that holds one or more complete images into the pnmreader,
+// such as a file mapped into memory. The rasters are decoded by up to
+// nthreads threads, so the callbacks can be called concurrently and out of
+// order, and must be thread-safe. The pixel and row callbacks are passed the
+// coordinates or row index as usual. Results are the same as with
+// pnmreader_feed(), except that the end of the buffer also terminates the
+// last sample of a plain image, and that after an error, pixels after the
+// error may have been passed to the callbacks as well. If a raster continues
+// past the end of the buffer, the complete rows are decoded in parallel and
+// the rest as pnmreader_feed() would, so that the remainder of the image can
+// be passed to pnmreader_feed(). A number at the end of the buffer is then
+// taken to continue in the remainder.
+enum pnmreader_result
+pnmreader_feed_parallel (struct pnmreader *, char *const data, size_t nbytes, unsigned int nthreads);
+
+// Pull interface: set the buffer that pnmreader_next_rows() decodes from.
+// The buffer must stay valid until pnmreader_next_rows() has used it up.
+void pnmreader_set_input (struct pnmreader *, char *const data, size_t nbytes);
+
+// Decode rows from the input buffer into dst, row n of the batch at dst + n
+// * stride, in the layout passed to the got_row callback. Decoding stops when
+// max_rows rows are stored, or at the end of the input buffer or the image.
+// The number of rows stored is returned in nrows. Returns PNMREADER_SUCCESS
+// if the batch is full and there may be more rows, PNMREADER_FEED_ME if the
+// input buffer is used up, in which case a partial row is kept for the next
+// buffer, and PNMREADER_FINISHED at the end of the image, also in multi-image
+// mode, so that a batch never spans two images. Returns PNMREADER_UNSUPPORTED
+// if the stride is too small for a row, or if a destination buffer is set.
+// Callbacks are still called. An image must be decoded either with this
+// function or with pnmreader_feed(), not both.
+enum pnmreader_result
+pnmreader_next_rows (struct pnmreader *, void *dst, size_t stride, unsigned int max_rows, unsigned int *nrows);
+
+// Returns the number of bytes of the last buffer passed to pnmreader_feed()
+// or pnmreader_set_input() that were used. After PNMREADER_FINISHED, this is
+// where the data following the image starts. Plain images end right after
+// their last sample, so the whitespace that follows it is left over.
+size_t pnmreader_get_consumed (struct pnmreader *);
+
+// Counters kept by a reader built with PNMREADER_STATS defined. Bytes are
+// counted by where they were used: in the header, in a plain or binary
+// raster, or skipped over by a seek or for the rows above and below a
+// region of interest in a binary raster. The columns left and right of a
+// region are stepped over within the raster, and counted with it. Feeds
+// counts the calls to pnmreader_feed(), pnmreader_feed_parallel() and
+// pnmreader_next_rows(), and the split counters how many of those ran out
+// of data inside a number or a binary pixel. Times are in nanoseconds,
+// those of the callbacks summed over all threads.
+struct pnmreader_stats
+{
+	uint64_t bytes_header;
+	uint64_t bytes_plain;
+	uint64_t bytes_binary;
+	uint64_t bytes_skipped;
+	uint64_t feeds;
+	uint64_t split_tokens;
+	uint64_t split_pixels;
+	uint64_t header_callbacks;
+	uint64_t pixel_callbacks;
+	uint64_t row_callbacks;
+	uint64_t ns_callbacks;
+	uint64_t ns_decoder;
+};
+
+// Copy the counters since the reader was created into stats. Returns false
+// if the reader was built without PNMREADER_STATS.
+bool pnmreader_get_stats (struct pnmreader *, struct pnmreader_stats *stats);
+
+// Prepare the pnmreader for reading the next image, keeping its callbacks and
+// allocations. Whitespace and comments before the next image are skipped.
+void pnmreader_reset (struct pnmreader *);
+
+// Enable or disable multi-image mode, for streams of concatenated images.
+// In this mode, the reader starts on the next image as soon as one is
+// finished, and calls the callbacks again for every image. pnmreader_feed()
+// returns PNMREADER_FINISHED when all data was used and the last image is
+// complete, or PNMREADER_FEED_ME when an image is still in progress.
+void pnmreader_set_multi (struct pnmreader *, bool multi);
+
+// Get the offset of a row of a binary image, counted from the first byte fed
+// to the reader. Returns false if the argument(s) are invalid, the header has
+// not been read, or the image is not binary.
+bool pnmreader_row_offset (struct pnmreader *, unsigned int row, uint64_t *offset);
+
+// Continue decoding a binary image at the given row, which can be before or
+// after the current one. The next data fed to the reader must start at the
+// offset of the row, so the caller must seek to it in the input. Cannot be
+// called from a callback. Returns false under the same conditions as
+// pnmreader_row_offset(), or if the row is outside the region of interest.
+bool pnmreader_seek_row (struct pnmreader *, unsigned int row);
+
+// Like pnmreader_seek_row(), but for inputs that cannot seek: the reader
+// skips the data up to the start of the row as it is fed, without decoding
+// it. The row must not start before the next byte to be fed. Returns false
+// otherwise, or under the same conditions as pnmreader_seek_row().
+bool pnmreader_skip_to_row (struct pnmreader *, unsigned int row);
+
+// Decode the rows into a buffer supplied by the caller instead of an internal
+// one: row n is stored at dest + n * stride, in the layout passed to the
+// got_row callback, which is then passed a pointer into the buffer. The
+// buffer must hold stride * height bytes. Decoding fails with
+// PNMREADER_UNSUPPORTED if the stride is too small for a row, or if the
+// buffer or stride is not aligned for 16-bit samples. Pass NULL to go back
+// to the internal buffer. Works for both pixel and row readers.
+void pnmreader_set_dest (struct pnmreader *, void *dest, size_t stride);
+
+// Layouts for pnmreader_decode_into(). Combine one sample type, one color
+// model, and optionally PNMREADER_PLANAR:
+enum pnmreader_layout {
+	PNMREADER_UINT8  = 0x00,
+	PNMREADER_UINT16 = 0x01,
+	PNMREADER_GRAY   = 0x00,
+	PNMREADER_RGB    = 0x02,
+	PNMREADER_PLANAR = 0x04,
+};
+
+// Like pnmreader_set_dest(), but store the rows in the given layout, which
+// is independent of the image format. Samples are scaled from the maxval
+// to the full range of the sample type; in PBM, black becomes 0. Gray
+// images are expanded to RGB by replicating the samples, and color images
+// are reduced to gray with the Rec. 601 luma weights. Of a PAM tuple, the
+// first sample or the first three are used, as for got_pixel. Row n is
+// stored at dest + n * stride. In the planar layout, the channels are
+// stored one after the other, each one as a full image: channel c of row n
+// is stored at dest + (c * height + n) * stride, where height is the height
+// of the region of interest. The buffer is filled as rows complete, so it
+// can be fed incrementally. A row callback, if any, is passed the row in
+// the native layout. The feed functions return PNMREADER_UNSUPPORTED if
+// the stride is too small for a row, or if the buffer or stride is not
+// aligned for 16-bit samples. Pass NULL to stop converting.
+void pnmreader_decode_into (struct pnmreader *, void *dest, size_t stride, unsigned int layout);
+
+// Only decode the pixels in a rectangle of the image; the rectangle is
+// clipped to the image. Callbacks are only made for pixels and rows in the
+// rectangle, and rows are passed and stored from the left edge of the
+// rectangle, as if it were the whole image: row n of the rectangle is stored
+// at dest + n * stride. In binary rasters, the pixels outside the rectangle
+// are skipped without being decoded or range-checked. Can be called from the
+// got_geometry callback, and stays in effect for the next images. Returns
+// false if the width or height is zero.
+bool pnmreader_set_roi (struct pnmreader *, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+
+// A binary PNM or PAM file mapped into memory by pnmreader_map_fd():
+struct pnmreader_map
+{
+	enum pnm_format format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int maxval;
+	unsigned int depth;
+
+	// Start of the raster, and the distance in bytes between the starts
+	// of consecutive rows. The samples are as stored in the file: packed
+	// bits for PBM, bytes for a maxval of at most 255, and big-endian
+	// 16-bit words otherwise.
+	const unsigned char *raster;
+	size_t stride;
+
+	// The file contents from the offset the map was made at, read-only.
+	// Can be passed to pnmreader_feed() as a single buffer.
+	void *data;
+	size_t size;
+
+	// The underlying mapping, for pnmreader_unmap():
+	void *mapping;
+	size_t mapsize;
+};
+
+// Map a binary PNM or PAM file into memory and parse its header.
+// Maps the file from the current file offset on, without reading from it.
+// Returns PNMREADER_SUCCESS on success, and fills the pnmreader_map struct.
+// Returns PNMREADER_UNSUPPORTED if the file is not a regular file (a pipe or
+// socket), or if it's in one of the plain formats. Use the streaming
+// interface in those cases. Returns PNMREADER_FEED_ME if the file is
+// truncated, or one of the other error codes if the header is invalid.
+enum pnmreader_result pnmreader_map_fd (int fd, struct pnmreader_map *);
+
+// Like pnmreader_map_fd(), but opens the file by name:
+enum pnmreader_result pnmreader_map_file (const char *path, struct pnmreader_map *);
+
+// Release a mapping made by pnmreader_map_fd() or pnmreader_map_file():
+void pnmreader_unmap (struct pnmreader_map *);
+
+// The header of a PNM or PAM file, as found by pnmreader_probe_fd():
+struct pnmreader_probe
+{
+	enum pnm_format format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int maxval;
+	unsigned int depth;
+
+	// Size of the header, which is the offset of the raster from where the
+	// probe started, and the size of the raster in bytes. The raster size
+	// is zero for the plain formats, whose size depends on the contents.
+	uint64_t header_size;
+	uint64_t raster_size;
+};
+
+// Parse only the header of the file, from the current file offset on, and
+// fill the pnmreader_probe struct. Does not allocate memory. Regular files
+// are read with pread(), leaving the file offset unchanged; other files such
+// as pipes are read byte by byte, consuming the header and nothing more.
+// Returns PNMREADER_SUCCESS on success. Returns PNMREADER_FEED_ME if the
+// file ends within the header, or if a regular file in a binary format is
+// too small to hold the raster. Returns PNMREADER_UNSUPPORTED on read
+// errors, or one of the other error codes if the header is invalid.
+enum pnmreader_result pnmreader_probe_fd (int fd, struct pnmreader_probe *);
+
+// Like pnmreader_probe_fd(), but opens the file by name:
+enum pnmreader_result pnmreader_probe_file (const char *path, struct pnmreader_probe *);
+
 // Retrieve the format code from the pnmreader object.
 // Returns false if the argument(s) are invalid or the format code has not been read.
 // Returns true on success, and writes the format code to the second argument.
@@ -74,4 +318,16 @@ bool pnmreader_get_geometry (struct pnmreader *, unsigned int *width, unsigned i
 // Returns true on success, and writes the max value to the second argument.
 bool pnmreader_get_maxval (struct pnmreader *, unsigned int *maxval);
 
+// Retrieve the number of samples per pixel: the depth of a PAM image, or 1
+// or 3 for the PNM formats. Available from the got_geometry callback on.
+// Returns false if the argument(s) are invalid or the depth is not known yet.
+bool pnmreader_get_depth (struct pnmreader *, unsigned int *depth);
+
+// Retrieve the tuple type of a PAM image, such as "RGB_ALPHA". It's empty if
+// the header has no TUPLTYPE line. The string is owned by the reader and
+// valid until the next image. Available from the got_geometry callback on.
+// Returns false if the argument(s) are invalid, the image is not a PAM
+// image, or the header has not been read.
+bool pnmreader_get_tupltype (struct pnmreader *, const char **tupltype);
+
 #endif
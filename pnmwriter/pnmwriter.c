@@ -1,20 +1,70 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "pnmwriter.h"
 
+#define LINELEN		70
+#define TUPLTYPE_MAX	255
+
+// Default size of the output buffer:
+#define BUFSIZE		(64 * 1024)
+
+// Most bytes a plain sample takes: a separator, five digits and a newline:
+#define VALUE_MAX	7
+
+// Plain rasters with fewer samples than this per thread are not worth
+// splitting:
+#define PARALLEL_MIN_SAMPLES	(1 << 16)
+
+enum sink {
+	SINK_FILE,
+	SINK_FD,
+	SINK_MEM,
+	SINK_CALLBACK
+};
+
 enum state {
 	STATE_FORMAT,
 	STATE_WIDTH,
 	STATE_HEIGHT,
+	STATE_DEPTH,
 	STATE_MAXVAL,
 	STATE_DATA,
 	STATE_FINISHED
 };
 
 struct pnmwriter {
+	// Where the output goes:
+	enum sink sink;
 	FILE *file;
+	int fd;
+	bool (*output) (const void *data, size_t nbytes, void *userdata);
+	void *userdata;
+
+	// Output is collected in the buffer and written to the sink in large
+	// blocks. Memory output stays in the buffer, which grows instead. A
+	// failed write is sticky:
+	char *buf;
+	size_t bufsize;
+	size_t buflen;
+	bool error;
+
+	// Number of bytes in the header:
+	uint64_t hdrsize;
+
 	enum state state;
 	enum pnm_format format;
 	bool breakcols;
@@ -22,14 +72,14 @@ struct pnmwriter {
 	unsigned int width;
 	unsigned int height;
 	unsigned int maxval;
+	unsigned int depth;
 	unsigned int col;
 	unsigned int row;
 	unsigned int linesize;
 	unsigned char binvalue;
+	char tupltype[TUPLTYPE_MAX + 1];
 };
 
-#define LINELEN	70
-
 static inline int
 numlen (unsigned int p)
 {
@@ -40,9 +90,210 @@ numlen (unsigned int p)
 	     : 5;
 }
 
+static bool
+write_out (struct pnmwriter *const pw, const char *data, size_t n)
+{
+	switch (pw->sink)
+	{
+		case SINK_FILE:
+			return fwrite(data, 1, n, pw->file) == n;
+
+		case SINK_FD:
+			// Write all of it, also after short writes and signals:
+			while (n > 0) {
+				ssize_t ret;
+
+				if ((ret = write(pw->fd, data, n)) < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					return false;
+				}
+				data += ret;
+				n -= ret;
+			}
+			return true;
+
+		case SINK_CALLBACK:
+			return pw->output(data, n, pw->userdata);
+
+		default:
+			return false;
+	}
+}
+
+static bool
+resize_buffer (struct pnmwriter *const pw, size_t size)
+{
+	char *buf;
+
+	if ((buf = realloc(pw->buf, size)) == NULL) {
+		return false;
+	}
+	pw->buf = buf;
+	pw->bufsize = size;
+	return true;
+}
+
+static bool
+flush_buffer (struct pnmwriter *const pw)
+{
+	// Memory output is the buffer itself:
+	if (pw->sink == SINK_MEM) {
+		return !pw->error;
+	}
+	if (pw->buflen > 0 && pw->error == false) {
+		if (write_out(pw, pw->buf, pw->buflen) == false) {
+			pw->error = true;
+		}
+	}
+	pw->buflen = 0;
+	return !pw->error;
+}
+
+static void
+make_room (struct pnmwriter *const pw, size_t n)
+{
+	// Make room for n more bytes, as far as the buffer can hold them. The
+	// buffer for memory output doubles in size until they fit; if that
+	// fails, the output so far is dropped:
+	if (pw->sink == SINK_MEM) {
+		size_t size = (pw->bufsize > 0) ? pw->bufsize : BUFSIZE;
+
+		while (size - pw->buflen < n && size <= SIZE_MAX / 2) {
+			size *= 2;
+		}
+		if (size - pw->buflen < n || resize_buffer(pw, size) == false) {
+			pw->error = true;
+			pw->buflen = 0;
+		}
+		return;
+	}
+	flush_buffer(pw);
+}
+
+static void
+put_bytes (struct pnmwriter *const pw, const char *s, size_t n)
+{
+	// Data that does not fit in an empty buffer is written directly:
+	if (pw->bufsize - pw->buflen < n) {
+		make_room(pw, n);
+		if (pw->bufsize - pw->buflen < n) {
+			if (pw->error == false && write_out(pw, s, n) == false) {
+				pw->error = true;
+			}
+			return;
+		}
+	}
+	memcpy(pw->buf + pw->buflen, s, n);
+	pw->buflen += n;
+}
+
+static inline void
+put_byte (struct pnmwriter *const pw, unsigned char c)
+{
+	// If the buffer has no room even now, leave the byte to put_bytes(),
+	// which writes it directly or records the error:
+	if (pw->buflen == pw->bufsize) {
+		make_room(pw, 1);
+		if (pw->buflen == pw->bufsize) {
+			put_bytes(pw, (const char *)&c, 1);
+			return;
+		}
+	}
+	pw->buf[pw->buflen++] = c;
+}
+
+static const char digit_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static inline char *
+format_uint (char *d, unsigned int p, int nchars)
+{
+	// Write the nchars digits two at a time, from the last pair backwards:
+	char *end = d + nchars;
+
+	d = end;
+	while (p >= 100) {
+		d -= 2;
+		memcpy(d, digit_pairs + (p % 100) * 2, 2);
+		p /= 100;
+	}
+	if (p >= 10) {
+		memcpy(d - 2, digit_pairs + p * 2, 2);
+	}
+	else {
+		d[-1] = '0' + p;
+	}
+	return end;
+}
+
+static void
+put_header (struct pnmwriter *const pw, const char *fmt, ...)
+{
+	// Header lines are short, apart from the tuple type:
+	char line[TUPLTYPE_MAX + 32];
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	if (n < 0 || (size_t)n >= sizeof(line)) {
+		pw->error = true;
+		return;
+	}
+	put_bytes(pw, line, n);
+	pw->hdrsize += n;
+}
+
+static bool
+output_size (const struct pnmwriter *const pw, uint64_t *size)
+{
+	uint64_t rowsize;
+
+	// Only the binary rasters have a size known from the header:
+	switch (pw->format)
+	{
+		case FORMAT_PBM_BIN:
+			rowsize = ((uint64_t)pw->width + 7) / 8;
+			break;
+
+		case FORMAT_PGM_BIN:
+		case FORMAT_PPM_BIN:
+		case FORMAT_PAM:
+			rowsize = (uint64_t)pw->width * ((pw->maxval < 256) ? 1 : 2);
+			if (pw->depth > UINT64_MAX / rowsize) {
+				return false;
+			}
+			rowsize *= pw->depth;
+			break;
+
+		default:
+			return false;
+	}
+	if (rowsize > (UINT64_MAX - pw->hdrsize) / pw->height) {
+		return false;
+	}
+	*size = pw->hdrsize + rowsize * pw->height;
+	return true;
+}
+
 static void
 write_header (struct pnmwriter *const pw)
 {
+	uint64_t size;
+
 	if (pw == NULL) {
 		return;
 	}
@@ -51,38 +302,47 @@ write_header (struct pnmwriter *const pw)
 			if (pw->format == FORMAT_UNKNOWN) {
 				return;
 			}
-			if (fprintf(pw->file, "P%u\n", pw->format) < 0) {
-				return;
-			}
+			put_header(pw, "P%u\n", pw->format);
 			pw->state = STATE_WIDTH;
 
 		case STATE_WIDTH:
 			if (pw->width == 0) {
 				return;
 			}
-			if (fprintf(pw->file, "%u ", pw->width) < 0) {
-				return;
-			}
+			put_header(pw, (pw->format == FORMAT_PAM) ? "WIDTH %u\n" : "%u ", pw->width);
 			pw->state = STATE_HEIGHT;
 
 		case STATE_HEIGHT:
 			if (pw->height == 0) {
 				return;
 			}
-			if (fprintf(pw->file, "%u\n", pw->height) < 0) {
+			put_header(pw, (pw->format == FORMAT_PAM) ? "HEIGHT %u\n" : "%u\n", pw->height);
+			pw->state = STATE_DEPTH;
+
+		case STATE_DEPTH:
+			// Only PAM has an explicit depth:
+			if (pw->depth == 0) {
 				return;
 			}
+			if (pw->format == FORMAT_PAM) {
+				put_header(pw, "DEPTH %u\n", pw->depth);
+			}
 			pw->state = STATE_MAXVAL;
 
 		case STATE_MAXVAL:
 			if (pw->maxval == 0) {
 				return;
 			}
-			if (pw->format != FORMAT_PBM_ASC
-			 && pw->format != FORMAT_PBM_BIN) {
-				if (fprintf(pw->file, "%u\n", pw->maxval) < 0) {
-					return;
+			if (pw->format == FORMAT_PAM) {
+				put_header(pw, "MAXVAL %u\n", pw->maxval);
+				if (pw->tupltype[0] != '\0') {
+					put_header(pw, "TUPLTYPE %s\n", pw->tupltype);
 				}
+				put_header(pw, "ENDHDR\n");
+			}
+			else if (pw->format != FORMAT_PBM_ASC
+			      && pw->format != FORMAT_PBM_BIN) {
+				put_header(pw, "%u\n", pw->maxval);
 				// For ascii formats, decide whether to wrap
 				// the lines based on the number of columns or
 				// the max line length. If the number of
@@ -97,6 +357,11 @@ write_header (struct pnmwriter *const pw)
 			}
 			pw->state = STATE_DATA;
 
+			// Memory output of a known size is allocated at once:
+			if (pw->sink == SINK_MEM && output_size(pw, &size) && size > pw->bufsize && size <= SIZE_MAX) {
+				resize_buffer(pw, size);
+			}
+
 		case STATE_DATA:
 		case STATE_FINISHED:
 			return;
@@ -125,6 +390,15 @@ pnmwriter_format (struct pnmwriter *const pw, enum pnm_format format)
 		}
 		pw->maxval = 1;
 	}
+	// The PNM formats imply the depth:
+	if (format != FORMAT_PAM) {
+		unsigned int depth = (format == FORMAT_PPM_ASC || format == FORMAT_PPM_BIN) ? 3 : 1;
+
+		if (pw->depth != 0 && pw->depth != depth) {
+			return false;
+		}
+		pw->depth = depth;
+	}
 	pw->format = format;
 	write_header(pw);
 	return true;
@@ -164,6 +438,46 @@ pnmwriter_height (struct pnmwriter *const pw, unsigned int height)
 	return true;
 }
 
+bool
+pnmwriter_depth (struct pnmwriter *const pw, unsigned int depth)
+{
+	if (pw == NULL) {
+		return false;
+	}
+	if (depth == 0) {
+		return false;
+	}
+	// For the PNM formats, only the implied depth is accepted:
+	if (pw->depth != 0) {
+		return (depth == pw->depth);
+	}
+	pw->depth = depth;
+	write_header(pw);
+	return true;
+}
+
+bool
+pnmwriter_tupltype (struct pnmwriter *const pw, const char *tupltype)
+{
+	size_t len;
+
+	if (pw == NULL || tupltype == NULL) {
+		return false;
+	}
+	if (pw->state > STATE_MAXVAL) {
+		return false;
+	}
+	if (pw->format != FORMAT_UNKNOWN && pw->format != FORMAT_PAM) {
+		return false;
+	}
+	// The tuple type is the rest of a header line:
+	if ((len = strlen(tupltype)) > TUPLTYPE_MAX || strpbrk(tupltype, "\n\r") != NULL) {
+		return false;
+	}
+	memcpy(pw->tupltype, tupltype, len + 1);
+	return true;
+}
+
 bool
 pnmwriter_maxval (struct pnmwriter *const pw, unsigned int maxval)
 {
@@ -187,68 +501,151 @@ pnmwriter_maxval (struct pnmwriter *const pw, unsigned int maxval)
 	return true;
 }
 
-static bool
-write_ascii_value (struct pnmwriter *const pw, unsigned int p)
+static inline char *
+format_ascii_value (char *d, unsigned int p, bool breakrow, unsigned int *linesize)
 {
 	int nchars = numlen(p);
 
 	// Keep a line length limit of LINELEN characters:
 	// Exactly enough space left:
-	if (pw->linesize + nchars + 1 == LINELEN - 1) {
-		if (fprintf(pw->file, " %u\n", p) < 0) {
-			return false;
-		}
-		pw->hasnewline = true;
-		pw->linesize = 0;
+	if (*linesize + nchars + 1 == LINELEN - 1) {
+		*d++ = ' ';
+		d = format_uint(d, p, nchars);
+		*d++ = '\n';
+		*linesize = 0;
 	}
 	// Not enough space left, break line first:
-	else if (pw->linesize + nchars + 1 >= LINELEN) {
-		if (fprintf(pw->file, "\n%u", p) < 0) {
-			return false;
-		}
-		pw->hasnewline = false;
-		pw->linesize = nchars;
+	else if (*linesize + nchars + 1 >= LINELEN) {
+		*d++ = '\n';
+		d = format_uint(d, p, nchars);
+		*linesize = nchars;
 	}
 	// We're breaking after full rows:
-	else if (pw->breakcols && pw->col == pw->width - 1) {
-		if (fprintf(pw->file, " %u\n", p) < 0) {
-			return false;
-		}
-		pw->hasnewline = true;
-		pw->linesize = 0;
+	else if (breakrow) {
+		*d++ = ' ';
+		d = format_uint(d, p, nchars);
+		*d++ = '\n';
+		*linesize = 0;
 	}
 	// Start of new line, print without leading space:
-	else if (pw->linesize == 0) {
-		if (fprintf(pw->file, "%u", p) < 0) {
-			return false;
-		}
-		pw->hasnewline = false;
-		pw->linesize = nchars;
+	else if (*linesize == 0) {
+		d = format_uint(d, p, nchars);
+		*linesize = nchars;
 	}
 	// Enough space, print normally with leading space:
 	else {
-		if (fprintf(pw->file, " %u", p) < 0) {
-			return false;
+		*d++ = ' ';
+		d = format_uint(d, p, nchars);
+		*linesize += nchars + 1;
+	}
+	return d;
+}
+
+static bool
+write_ascii_value (struct pnmwriter *const pw, unsigned int p)
+{
+	const bool breakrow = pw->breakcols && pw->col == pw->width - 1;
+	unsigned int linesize = pw->linesize;
+	char value[VALUE_MAX];
+
+	// Format straight into the buffer if it has room:
+	if (pw->bufsize - pw->buflen < VALUE_MAX) {
+		make_room(pw, VALUE_MAX);
+	}
+	if (pw->bufsize - pw->buflen < VALUE_MAX) {
+		put_bytes(pw, value, format_ascii_value(value, p, breakrow, &linesize) - value);
+	}
+	else {
+		char *d = pw->buf + pw->buflen;
+
+		pw->buflen = format_ascii_value(d, p, breakrow, &linesize) - pw->buf;
+	}
+	pw->hasnewline = (linesize == 0);
+	pw->linesize = linesize;
+	return !pw->error;
+}
+
+static void
+write_ascii_row (struct pnmwriter *const pw, const void *samples)
+{
+	const uint8_t *p8 = samples;
+	const uint16_t *p16 = samples;
+	const size_t n = (size_t)pw->width * pw->depth;
+
+	// With row breaks, all samples of the last pixel end in a newline:
+	const size_t breakfrom = pw->breakcols ? n - pw->depth : n;
+	unsigned int linesize = pw->linesize;
+	size_t i = 0;
+
+	while (i < n) {
+		size_t room = (pw->bufsize - pw->buflen) / VALUE_MAX;
+		char *d;
+
+		if (room == 0) {
+			make_room(pw, VALUE_MAX);
+			if ((room = (pw->bufsize - pw->buflen) / VALUE_MAX) == 0) {
+				pw->col = i / pw->depth;
+				pw->linesize = linesize;
+				write_ascii_value(pw, (pw->maxval < 256) ? p8[i] : p16[i]);
+				linesize = pw->linesize;
+				i++;
+				continue;
+			}
 		}
-		pw->hasnewline = false;
-		pw->linesize += nchars + 1;
+		// Format as many samples as surely fit:
+		if (room > n - i) {
+			room = n - i;
+		}
+		d = pw->buf + pw->buflen;
+		if (pw->maxval < 256) {
+			for (size_t end = i + room; i < end; i++) {
+				d = format_ascii_value(d, p8[i], i >= breakfrom, &linesize);
+			}
+		}
+		else {
+			for (size_t end = i + room; i < end; i++) {
+				d = format_ascii_value(d, p16[i], i >= breakfrom, &linesize);
+			}
+		}
+		pw->buflen = d - pw->buf;
 	}
-	return true;
+	pw->hasnewline = (linesize == 0);
+	pw->linesize = linesize;
 }
 
 static bool
 write_binary_value (struct pnmwriter *const pw, unsigned int p)
 {
 	if (pw->maxval < 256) {
-		fputc(p, pw->file);
-		return (!feof(pw->file));
+		put_byte(pw, p);
+		return !pw->error;
 	}
-	fputc((p >> 8) & 0xff, pw->file);
-	if (feof(pw->file)) {
-		return false;
+	put_byte(pw, (p >> 8) & 0xff);
+	put_byte(pw, p & 0xff);
+	return !pw->error;
+}
+
+static bool
+next_pixel (struct pnmwriter *const pw)
+{
+	pw->col++;
+	if (pw->col == pw->width) {
+		pw->col = 0;
+		pw->row++;
+	}
+	if (pw->row == pw->height) {
+		pw->state = STATE_FINISHED;
+		if (pw->format == FORMAT_PBM_ASC
+		 || pw->format == FORMAT_PGM_ASC
+		 || pw->format == FORMAT_PPM_ASC) {
+			if (pw->hasnewline == false) {
+				put_byte(pw, '\n');
+			}
+		}
+		// Hand the finished image to the file:
+		return flush_buffer(pw);
 	}
-	fputc(p & 0xff, pw->file);
-	return (!feof(pw->file));
+	return !pw->error;
 }
 
 bool
@@ -257,7 +654,7 @@ pnmwriter_pixel (struct pnmwriter *const pw, unsigned int r, unsigned int g, uns
 	if (pw == NULL) {
 		return false;
 	}
-	if (pw->state != STATE_DATA) {
+	if (pw->state != STATE_DATA || pw->error) {
 		return false;
 	}
 	if (r > pw->maxval) {
@@ -273,22 +670,13 @@ pnmwriter_pixel (struct pnmwriter *const pw, unsigned int r, unsigned int g, uns
 	{
 		case FORMAT_PBM_ASC:
 			if (pw->linesize == LINELEN - 1) {
-				fputc('\n', pw->file);
-				if (feof(pw->file)) {
-					return false;
-				}
+				put_byte(pw, '\n');
 				pw->hasnewline = true;
 				pw->linesize = 0;
 			}
-			fputc((r == 1) ? '1' : '0', pw->file);
-			if (feof(pw->file)) {
-				return false;
-			}
+			put_byte(pw, (r == 1) ? '1' : '0');
 			if (pw->col == pw->width - 1) {
-				fputc('\n', pw->file);
-				if (feof(pw->file)) {
-					return false;
-				}
+				put_byte(pw, '\n');
 				pw->hasnewline = true;
 				pw->linesize = 0;
 			}
@@ -319,10 +707,7 @@ pnmwriter_pixel (struct pnmwriter *const pw, unsigned int r, unsigned int g, uns
 			// Must collect 8 pixels to make output,
 			// or this must be the last bit in the row:
 			if (pw->col % 8 == 7 || pw->col == pw->width - 1) {
-				fputc(pw->binvalue, pw->file);
-				if (feof(pw->file)) {
-					return false;
-				}
+				put_byte(pw, pw->binvalue);
 				pw->binvalue = 0;
 			}
 			break;
@@ -341,41 +726,514 @@ pnmwriter_pixel (struct pnmwriter *const pw, unsigned int r, unsigned int g, uns
 			}
 			break;
 
+		case FORMAT_PAM:
+			// Only grayscale and color tuples can be given as r, g, b:
+			if (pw->depth == 1) {
+				if (write_binary_value(pw, r) == false) {
+					return false;
+				}
+				break;
+			}
+			if (pw->depth == 3) {
+				if (write_binary_value(pw, r) == false
+				 || write_binary_value(pw, g) == false
+				 || write_binary_value(pw, b) == false) {
+					return false;
+				}
+				break;
+			}
+			return false;
+
 		default: return false;
 	}
-	pw->col++;
-	if (pw->col == pw->width) {
-		pw->col = 0;
-		pw->row++;
+	return next_pixel(pw);
+}
+
+bool
+pnmwriter_tuple (struct pnmwriter *const pw, const unsigned int *samples)
+{
+	if (pw == NULL || samples == NULL) {
+		return false;
 	}
-	if (pw->row == pw->height) {
-		pw->state = STATE_FINISHED;
-		if (pw->format == FORMAT_PBM_ASC
-		 || pw->format == FORMAT_PGM_ASC
-		 || pw->format == FORMAT_PPM_ASC) {
-			if (pw->hasnewline == false) {
-				fputc('\n', pw->file);
-				if (feof(pw->file)) {
-					return false;
-				}
+	// The PNM formats take their one or three samples as a pixel:
+	if (pw->format != FORMAT_PAM) {
+		return (pw->depth == 3)
+			? pnmwriter_pixel(pw, samples[0], samples[1], samples[2])
+			: pnmwriter_pixel(pw, samples[0], samples[0], samples[0]);
+	}
+	if (pw->state != STATE_DATA || pw->error) {
+		return false;
+	}
+	for (unsigned int i = 0; i < pw->depth; i++) {
+		if (samples[i] > pw->maxval) {
+			return false;
+		}
+	}
+	for (unsigned int i = 0; i < pw->depth; i++) {
+		if (write_binary_value(pw, samples[i]) == false) {
+			return false;
+		}
+	}
+	return next_pixel(pw);
+}
+
+// Returns true if none of the 8-bit samples exceeds maxval:
+static bool
+in_range_8 (const uint8_t *p, size_t n, unsigned int maxval)
+{
+	size_t i = 0;
+
+	if (maxval >= 0xFF) {
+		return true;
+	}
+#if defined(__AVX2__)
+	const __m256i lim32 = _mm256_set1_epi8((char)maxval);
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i ok = _mm256_cmpeq_epi8(_mm256_max_epu8(v, lim32), lim32);
+		if ((unsigned int)_mm256_movemask_epi8(ok) != 0xFFFFFFFF) {
+			return false;
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lim16 = _mm_set1_epi8((char)maxval);
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i ok = _mm_cmpeq_epi8(_mm_max_epu8(v, lim16), lim16);
+		if (_mm_movemask_epi8(ok) != 0xFFFF) {
+			return false;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (p[i] > maxval) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns true if none of the native 16-bit samples exceeds maxval:
+static bool
+in_range_16 (const uint16_t *p, size_t n, unsigned int maxval)
+{
+	size_t i = 0;
+
+	if (maxval >= 0xFFFF) {
+		return true;
+	}
+	// Saturating subtraction yields zero for every sample in range:
+#if defined(__AVX2__)
+	const __m256i lim32 = _mm256_set1_epi16((short)maxval);
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i ok = _mm256_cmpeq_epi16(_mm256_subs_epu16(v, lim32), _mm256_setzero_si256());
+		if ((unsigned int)_mm256_movemask_epi8(ok) != 0xFFFFFFFF) {
+			return false;
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lim16 = _mm_set1_epi16((short)maxval);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i ok = _mm_cmpeq_epi16(_mm_subs_epu16(v, lim16), _mm_setzero_si128());
+		if (_mm_movemask_epi8(ok) != 0xFFFF) {
+			return false;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (p[i] > maxval) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Convert native 16-bit samples to big-endian bytes:
+static void
+swap_16 (unsigned char *dst, const uint16_t *src, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *)(dst + i * 2), v);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + i * 2), v);
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i * 2 + 0] = src[i] >> 8;
+		dst[i * 2 + 1] = src[i] & 0xFF;
+	}
+}
+
+static void
+put_samples_16 (struct pnmwriter *const pw, const uint16_t *p, size_t n)
+{
+	// Swap the samples straight into the buffer, as many as fit at a time:
+	while (n > 0) {
+		size_t room = (pw->bufsize - pw->buflen) / 2;
+
+		if (room == 0) {
+			make_room(pw, 2);
+
+			// A buffer too small for a sample takes the bytes singly:
+			if ((room = (pw->bufsize - pw->buflen) / 2) == 0) {
+				put_byte(pw, *p >> 8);
+				put_byte(pw, *p++ & 0xFF);
+				n--;
+				continue;
 			}
 		}
+		if (room > n) {
+			room = n;
+		}
+		swap_16((unsigned char *)pw->buf + pw->buflen, p, room);
+		pw->buflen += room * 2;
+		p += room;
+		n -= room;
+	}
+}
+
+static void
+write_row (struct pnmwriter *const pw, const void *samples)
+{
+	const size_t n = (size_t)pw->width * pw->depth;
+	const uint8_t *p8 = samples;
+	const uint16_t *p16 = samples;
+
+	switch (pw->format)
+	{
+		case FORMAT_PBM_ASC:
+			// Same line breaks as pnmwriter_pixel():
+			for (unsigned int col = 0; col < pw->width; col++) {
+				if (pw->linesize == LINELEN - 1) {
+					put_byte(pw, '\n');
+					pw->linesize = 0;
+				}
+				put_byte(pw, (p8[col] == 1) ? '1' : '0');
+				pw->linesize++;
+			}
+			put_byte(pw, '\n');
+			pw->hasnewline = true;
+			pw->linesize = 0;
+			break;
+
+		case FORMAT_PBM_BIN:
+			// Pack eight pixels per byte, padding the last one:
+			for (unsigned int col = 0; col < pw->width; col += 8) {
+				unsigned char byte = 0;
+
+				for (unsigned int i = 0; i < 8 && col + i < pw->width; i++) {
+					if (p8[col + i] == 1) {
+						byte |= 0x80 >> i;
+					}
+				}
+				put_byte(pw, byte);
+			}
+			break;
+
+		case FORMAT_PGM_ASC:
+		case FORMAT_PPM_ASC:
+			write_ascii_row(pw, samples);
+			break;
+
+		default:
+			// The binary rasters are the samples themselves:
+			if (pw->maxval < 256) {
+				put_bytes(pw, samples, n);
+			}
+			else {
+				put_samples_16(pw, p16, n);
+			}
+			break;
+	}
+	// Advance to the next row as if the last pixel was written:
+	pw->col = pw->width - 1;
+	next_pixel(pw);
+}
+
+static bool
+rows_valid (const struct pnmwriter *const pw, const void *samples, size_t stride, unsigned int nrows)
+{
+	size_t rowsize;
+
+	if (pw == NULL || samples == NULL) {
+		return false;
+	}
+	if (pw->state != STATE_DATA || pw->error) {
+		return false;
+	}
+	// Rows must start at the left edge and fit in the image:
+	if (pw->col != 0 || nrows > pw->height - pw->row) {
+		return false;
+	}
+	rowsize = (size_t)pw->width * pw->depth * ((pw->maxval < 256) ? 1 : 2);
+	if (nrows > 1 && stride < rowsize) {
+		return false;
+	}
+	// 16-bit samples are read in place:
+	if (pw->maxval > 255 && ((uintptr_t)samples % 2 != 0 || (nrows > 1 && stride % 2 != 0))) {
+		return false;
 	}
 	return true;
 }
 
-struct pnmwriter *
-pnmwriter_create (FILE *file)
+static inline bool
+row_in_range (const struct pnmwriter *const pw, const void *row)
+{
+	const size_t n = (size_t)pw->width * pw->depth;
+
+	return (pw->maxval < 256)
+		? in_range_8(row, n, pw->maxval)
+		: in_range_16(row, n, pw->maxval);
+}
+
+static bool
+write_rows (struct pnmwriter *const pw, const void *samples, size_t stride, unsigned int nrows, bool check)
+{
+	if (rows_valid(pw, samples, stride, nrows) == false) {
+		return false;
+	}
+	for (unsigned int i = 0; i < nrows; i++) {
+		const void *row = (const char *)samples + i * stride;
+
+		if (check && row_in_range(pw, row) == false) {
+			return false;
+		}
+		write_row(pw, row);
+	}
+	return !pw->error;
+}
+
+// A block of rows of a plain raster, as formatted by one worker thread into
+// a memory writer of its own, a copy of the real one:
+struct worker
+{
+	struct pnmwriter pw;
+	pthread_t thread;
+	bool started;
+
+	const char *samples;
+	size_t stride;
+	unsigned int nrows;
+};
+
+static void *
+format_block (void *arg)
+{
+	struct worker *w = arg;
+	const size_t n = (size_t)w->pw.width * w->pw.depth;
+
+	// Size the buffer for the typical sample; it grows if needed:
+	resize_buffer(&w->pw, (w->pw.format == FORMAT_PBM_ASC)
+		? (size_t)w->nrows * (n + n / (LINELEN - 1) + 1)
+		: (size_t)w->nrows * (n * (numlen(w->pw.maxval) + 1) + 1));
+
+	for (unsigned int i = 0; i < w->nrows; i++) {
+		write_row(&w->pw, w->samples + i * w->stride);
+	}
+	return NULL;
+}
+
+static unsigned int
+replay_rows (const struct pnmwriter *const pw, const char *samples, size_t stride, unsigned int nrows, unsigned int linesize)
+{
+	// Returns the line length after the rows, found by taking the line
+	// breaks of format_ascii_value() without formatting anything:
+	const size_t n = (size_t)pw->width * pw->depth;
+	const size_t breakfrom = pw->breakcols ? n - pw->depth : n;
+
+	for (unsigned int row = 0; row < nrows; row++) {
+		const uint8_t *p8 = (const uint8_t *)(samples + row * stride);
+		const uint16_t *p16 = (const uint16_t *)(samples + row * stride);
+
+		for (size_t i = 0; i < n; i++) {
+			unsigned int nchars = numlen((pw->maxval < 256) ? p8[i] : p16[i]);
+
+			if (linesize + nchars + 1 == LINELEN - 1) {
+				linesize = 0;
+			}
+			else if (linesize + nchars + 1 >= LINELEN) {
+				linesize = nchars;
+			}
+			else if (i >= breakfrom) {
+				linesize = 0;
+			}
+			else if (linesize == 0) {
+				linesize = nchars;
+			}
+			else {
+				linesize += nchars + 1;
+			}
+		}
+	}
+	return linesize;
+}
+
+static void
+write_ascii_parallel (struct pnmwriter *const pw, const char *samples, size_t stride, unsigned int nrows, unsigned int nthreads)
+{
+	// The rows are divided into blocks, which are formatted concurrently
+	// and written out in order. A block must start with the line length
+	// that the rows before it leave. Bitmaps end every row with a newline,
+	// and so do images that break after each row: in grayscale, a whole
+	// row fits on a line, and in color, the green sample of the last pixel
+	// ends a line or starts one, so that the blue one fits after it and
+	// ends the line. Otherwise, this thread replays the line breaks of each
+	// block while the workers format the blocks before it:
+	const bool restart = (pw->format == FORMAT_PBM_ASC || pw->breakcols);
+	const size_t nsamples = (size_t)nrows * pw->width * pw->depth;
+	size_t nworkers = nsamples / PARALLEL_MIN_SAMPLES;
+	unsigned int linesize = pw->linesize;
+	unsigned int row = 0;
+	struct worker *w;
+
+	if (nworkers > nthreads) {
+		nworkers = nthreads;
+	}
+	if (nworkers > nrows) {
+		nworkers = nrows;
+	}
+	if (nworkers < 2 || (w = malloc(nworkers * sizeof(*w))) == NULL) {
+		for (unsigned int i = 0; i < nrows; i++) {
+			write_row(pw, samples + i * stride);
+		}
+		return;
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		unsigned int next = (uint64_t)nrows * (i + 1) / nworkers;
+
+		w[i].pw = *pw;
+		w[i].pw.sink = SINK_MEM;
+		w[i].pw.buf = NULL;
+		w[i].pw.bufsize = 0;
+		w[i].pw.buflen = 0;
+		w[i].pw.linesize = linesize;
+		w[i].pw.row = pw->row + row;
+		w[i].samples = samples + row * stride;
+		w[i].stride = stride;
+		w[i].nrows = next - row;
+
+		// The last block is formatted on this thread, as is a block
+		// whose thread cannot be started:
+		w[i].started = (i + 1 < nworkers && pthread_create(&w[i].thread, NULL, format_block, &w[i]) == 0);
+		if (w[i].started == false) {
+			format_block(&w[i]);
+		}
+		if (i + 1 < nworkers) {
+			linesize = restart ? 0 : replay_rows(pw, w[i].samples, stride, w[i].nrows, linesize);
+		}
+		row = next;
+	}
+	for (size_t i = 0; i < nworkers; i++) {
+		if (w[i].started) {
+			pthread_join(w[i].thread, NULL);
+		}
+		// A block that did not fit in memory is formatted here instead:
+		if (w[i].pw.error) {
+			free(w[i].pw.buf);
+			for (unsigned int j = 0; j < w[i].nrows; j++) {
+				write_row(pw, w[i].samples + j * stride);
+			}
+			continue;
+		}
+		put_bytes(pw, w[i].pw.buf, w[i].pw.buflen);
+		free(w[i].pw.buf);
+
+		pw->state = w[i].pw.state;
+		pw->hasnewline = w[i].pw.hasnewline;
+		pw->linesize = w[i].pw.linesize;
+		pw->col = w[i].pw.col;
+		pw->row = w[i].pw.row;
+	}
+	if (pw->state == STATE_FINISHED) {
+		flush_buffer(pw);
+	}
+	free(w);
+}
+
+bool
+pnmwriter_row (struct pnmwriter *const pw, const void *samples)
+{
+	return write_rows(pw, samples, 0, 1, true);
+}
+
+bool
+pnmwriter_rows (struct pnmwriter *const pw, const void *samples, size_t stride, unsigned int nrows)
+{
+	return write_rows(pw, samples, stride, nrows, true);
+}
+
+bool
+pnmwriter_rows_unchecked (struct pnmwriter *const pw, const void *samples, size_t stride, unsigned int nrows)
+{
+	return write_rows(pw, samples, stride, nrows, false);
+}
+
+bool
+pnmwriter_rows_parallel (struct pnmwriter *const pw, const void *samples, size_t stride, unsigned int nrows, unsigned int nthreads)
+{
+	unsigned int nvalid = 0;
+
+	if (rows_valid(pw, samples, stride, nrows) == false) {
+		return false;
+	}
+	// Binary rasters take no formatting to speak of:
+	if (pw->format != FORMAT_PBM_ASC
+	 && pw->format != FORMAT_PGM_ASC
+	 && pw->format != FORMAT_PPM_ASC) {
+		return write_rows(pw, samples, stride, nrows, true);
+	}
+	// Write the rows before the first one out of range:
+	while (nvalid < nrows && row_in_range(pw, (const char *)samples + nvalid * stride)) {
+		nvalid++;
+	}
+	write_ascii_parallel(pw, samples, stride, nvalid, nthreads);
+	return nvalid == nrows && !pw->error;
+}
+
+static struct pnmwriter *
+create (enum sink sink)
 {
 	struct pnmwriter *pw;
 
 	if ((pw = malloc(sizeof(*pw))) == NULL) {
 		return NULL;
 	}
-	pw->file = file;
+	if ((pw->buf = malloc(BUFSIZE)) == NULL) {
+		free(pw);
+		return NULL;
+	}
+	pw->sink = sink;
+	pw->file = NULL;
+	pw->fd = -1;
+	pw->output = NULL;
+	pw->userdata = NULL;
+	pw->bufsize = BUFSIZE;
+	pw->buflen = 0;
+	pw->error = false;
+	pw->hdrsize = 0;
 	pw->width = 0;
 	pw->height = 0;
 	pw->maxval = 0;
+	pw->depth = 0;
+	pw->tupltype[0] = '\0';
 	pw->format = FORMAT_UNKNOWN;
 	pw->state = STATE_FORMAT;
 	pw->breakcols = false;
@@ -387,8 +1245,114 @@ pnmwriter_create (FILE *file)
 	return pw;
 }
 
+struct pnmwriter *
+pnmwriter_create (FILE *file)
+{
+	struct pnmwriter *pw;
+
+	if ((pw = create(SINK_FILE)) != NULL) {
+		pw->file = file;
+	}
+	return pw;
+}
+
+struct pnmwriter *
+pnmwriter_create_fd (int fd)
+{
+	struct pnmwriter *pw;
+
+	if ((pw = create(SINK_FD)) != NULL) {
+		pw->fd = fd;
+	}
+	return pw;
+}
+
+struct pnmwriter *
+pnmwriter_create_mem (void)
+{
+	return create(SINK_MEM);
+}
+
+struct pnmwriter *
+pnmwriter_create_callback (bool (*output) (const void *data, size_t nbytes, void *userdata), void *userdata)
+{
+	struct pnmwriter *pw;
+
+	if (output == NULL) {
+		return NULL;
+	}
+	if ((pw = create(SINK_CALLBACK)) != NULL) {
+		pw->output = output;
+		pw->userdata = userdata;
+	}
+	return pw;
+}
+
+bool
+pnmwriter_bufsize (struct pnmwriter *const pw, size_t size)
+{
+	if (pw == NULL || size == 0) {
+		return false;
+	}
+	// Write out what is pending before resizing, or for memory output,
+	// keep it:
+	if (flush_buffer(pw) == false || size < pw->buflen) {
+		return false;
+	}
+	return resize_buffer(pw, size);
+}
+
+bool
+pnmwriter_get_size (struct pnmwriter *const pw, uint64_t *size)
+{
+	if (pw == NULL || size == NULL) {
+		return false;
+	}
+	if (pw->state < STATE_DATA) {
+		return false;
+	}
+	return output_size(pw, size);
+}
+
+void *
+pnmwriter_take_mem (struct pnmwriter *const pw, size_t *nbytes)
+{
+	void *buf;
+
+	if (pw == NULL || nbytes == NULL) {
+		return NULL;
+	}
+	if (pw->sink != SINK_MEM || pw->state != STATE_FINISHED || pw->error) {
+		return NULL;
+	}
+	// Hand over the buffer; the writer keeps none:
+	buf = pw->buf;
+	*nbytes = pw->buflen;
+	pw->buf = NULL;
+	pw->bufsize = 0;
+	pw->buflen = 0;
+	return buf;
+}
+
+bool
+pnmwriter_flush (struct pnmwriter *const pw)
+{
+	if (pw == NULL) {
+		return false;
+	}
+	if (flush_buffer(pw) && pw->sink == SINK_FILE && fflush(pw->file) != 0) {
+		pw->error = true;
+	}
+	return !pw->error;
+}
+
 void
 pnmwriter_destroy (struct pnmwriter *const pw)
 {
+	if (pw == NULL) {
+		return;
+	}
+	flush_buffer(pw);
+	free(pw->buf);
 	free(pw);
 }
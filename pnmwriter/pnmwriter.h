@@ -1,6 +1,8 @@
 #ifndef PNMWRITER_H
 #define PNMWRITER_H
 
+#include <stdint.h>
+
 #ifndef PNM_FORMAT
 #define PNM_FORMAT
 enum pnm_format
@@ -11,23 +13,98 @@ enum pnm_format
 	FORMAT_PPM_ASC,
 	FORMAT_PBM_BIN,
 	FORMAT_PGM_BIN,
-	FORMAT_PPM_BIN
+	FORMAT_PPM_BIN,
+	FORMAT_PAM
 };
 #endif
 
+// Output is collected in an internal buffer and written to the file in
+// large blocks, when the buffer fills up, when the image is finished, and
+// on flush or destroy:
 struct pnmwriter * pnmwriter_create (FILE *file);
 
-// Destroy the pnmreader struct:
+// Like pnmwriter_create(), but write the output to a file descriptor with
+// write(2). The descriptor is not closed:
+struct pnmwriter * pnmwriter_create_fd (int fd);
+
+// Create a pnmwriter that keeps its output in memory, in a buffer that grows
+// as needed. For binary images, the buffer is allocated at the exact output
+// size when the header is complete. Take the output with
+// pnmwriter_take_mem():
+struct pnmwriter * pnmwriter_create_mem (void);
+
+// Like pnmwriter_create(), but pass each block of output to a callback,
+// which returns false on error. The data is only valid for the duration of
+// the callback:
+struct pnmwriter * pnmwriter_create_callback
+(
+	bool (*output) (const void *data, size_t nbytes, void *userdata),
+	void *userdata
+);
+
+// Write out any buffered output and destroy the pnmwriter struct:
 void pnmwriter_destroy (struct pnmwriter *const);
 
+// Change the size of the output buffer, in bytes. Buffered output is
+// written out first. The output of a memory writer is the buffer, which can
+// not be made smaller than the output so far:
+bool pnmwriter_bufsize (struct pnmwriter *const, size_t size);
+
+// Get the exact size in bytes of the output, including the header. Only
+// known for binary images, once the header is complete:
+bool pnmwriter_get_size (struct pnmwriter *const, uint64_t *size);
+
+// Take over the output of a memory writer, without copying: returns the
+// buffer, to be freed by the caller, and its length in nbytes. Returns NULL
+// if the image is not finished or a write failed:
+void * pnmwriter_take_mem (struct pnmwriter *const, size_t *nbytes);
+
+// Write out the buffered output and flush the file. Write errors are sticky:
+// returns false if any write failed since the writer was created, after
+// which all pixels are refused:
+bool pnmwriter_flush (struct pnmwriter *const);
+
 bool pnmwriter_format (struct pnmwriter *const, enum pnm_format format);
 
 bool pnmwriter_width (struct pnmwriter *const, unsigned int width);
 
 bool pnmwriter_height (struct pnmwriter *const, unsigned int height);
 
+// The number of samples per pixel. Required for PAM; the PNM formats only
+// accept the depth they imply, 1 or 3:
+bool pnmwriter_depth (struct pnmwriter *const, unsigned int depth);
+
+// Optional PAM tuple type, such as "RGB_ALPHA". Must be set before the
+// header is complete:
+bool pnmwriter_tupltype (struct pnmwriter *const, const char *tupltype);
+
 bool pnmwriter_maxval (struct pnmwriter *const, unsigned int maxval);
 
 bool pnmwriter_pixel (struct pnmwriter *const, unsigned int r, unsigned int g, unsigned int b);
 
+// Write a pixel as an array of samples, as many as the depth:
+bool pnmwriter_tuple (struct pnmwriter *const, const unsigned int *samples);
+
+// Write a whole row, starting at the left edge of the image. The samples are
+// interleaved, as many per pixel as the depth: uint8_t when maxval is at most
+// 255, else uint16_t in native byte order, which must be aligned. This is the
+// layout of the pnmreader row callback. Returns false if a sample exceeds
+// maxval, in which case nothing is written:
+bool pnmwriter_row (struct pnmwriter *const, const void *samples);
+
+// Write nrows rows, row n at samples + n * stride, as with pnmwriter_row().
+// The rows are checked and written one by one, so the rows before one with
+// an out-of-range sample are written:
+bool pnmwriter_rows (struct pnmwriter *const, const void *samples, size_t stride, unsigned int nrows);
+
+// Like pnmwriter_rows(), but without checking the samples against maxval,
+// for callers that guarantee them, such as a pnmreader row callback:
+bool pnmwriter_rows_unchecked (struct pnmwriter *const, const void *samples, size_t stride, unsigned int nrows);
+
+// Like pnmwriter_rows(), but format the rows of plain images on up to
+// nthreads threads, each into a buffer of its own. The buffers are written
+// out in order, so the output is the same. Binary images are written as by
+// pnmwriter_rows():
+bool pnmwriter_rows_parallel (struct pnmwriter *const, const void *samples, size_t stride, unsigned int nrows, unsigned int nthreads);
+
 #endif
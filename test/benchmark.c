@@ -0,0 +1,244 @@
+// Throughput benchmark for pnmreader and pnmwriter. Synthetic images in all
+// six PNM formats are written into memory with pnmwriter, then decoded with
+// pnmreader in buffers of 1 byte up to 16 MiB. The results are printed to
+// stdout as CSV, one line per run, for comparing builds.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../pnmreader/pnmreader.h"
+#include "../pnmwriter/pnmwriter.h"
+
+// Runs are repeated until they took at least this long in total:
+#define MIN_SECONDS	0.1
+
+// Runs with small buffers decode at most this many buffers of an image:
+#define MAX_FEEDS	(1 << 20)
+
+struct image
+{
+	enum pnm_format format;
+	unsigned int maxval;
+	unsigned int width;
+	unsigned int height;
+
+	// Number of comment lines in the header:
+	unsigned int comments;
+
+	char *data;
+	size_t nbytes;
+};
+
+static const char *format_names[] = {
+	[FORMAT_PBM_ASC] = "P1",
+	[FORMAT_PGM_ASC] = "P2",
+	[FORMAT_PPM_ASC] = "P3",
+	[FORMAT_PBM_BIN] = "P4",
+	[FORMAT_PGM_BIN] = "P5",
+	[FORMAT_PPM_BIN] = "P6",
+};
+
+static const size_t feed_sizes[] = {
+	1, 16, 256, 4096, 65536, 1 << 20, 1 << 24
+};
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint32_t
+xorshift (uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static bool
+write_image (struct image *img)
+{
+	// Write the image with pseudorandom but repeatable pixels:
+	struct pnmwriter *pw;
+	uint32_t state = 2463534242;
+	bool ok;
+
+	if ((pw = pnmwriter_create_mem()) == NULL) {
+		return false;
+	}
+	ok = pnmwriter_format(pw, img->format)
+	  && pnmwriter_width(pw, img->width)
+	  && pnmwriter_height(pw, img->height)
+	  && pnmwriter_maxval(pw, img->maxval);
+
+	for (size_t i = 0; ok && i < (size_t)img->width * img->height; i++) {
+		uint32_t v = xorshift(&state);
+
+		ok = pnmwriter_pixel(pw,
+			(v & 0xFFFF) % (img->maxval + 1),
+			(v >> 8 & 0xFFFF) % (img->maxval + 1),
+			(v >> 16) % (img->maxval + 1));
+	}
+	img->data = ok ? pnmwriter_take_mem(pw, &img->nbytes) : NULL;
+	pnmwriter_destroy(pw);
+	return img->data != NULL;
+}
+
+static bool
+add_comments (struct image *img)
+{
+	// Insert comment lines after the magic number, which the writer
+	// ends with a newline:
+	static const char line[] = "# A comment line in the header, as written by some tools\n";
+	size_t len = (size_t)img->comments * (sizeof(line) - 1);
+	char *data;
+
+	if ((data = malloc(img->nbytes + len)) == NULL) {
+		return false;
+	}
+	memcpy(data, img->data, 3);
+	for (unsigned int i = 0; i < img->comments; i++) {
+		memcpy(data + 3 + i * (sizeof(line) - 1), line, sizeof(line) - 1);
+	}
+	memcpy(data + 3 + len, img->data + 3, img->nbytes - 3);
+	free(img->data);
+	img->data = data;
+	img->nbytes += len;
+	return true;
+}
+
+static bool
+got_row (unsigned int row, const void *samples, void *data)
+{
+	(*(uint64_t *)data)++;
+	return true;
+}
+
+static void
+print_result (const char *op, const struct image *img, size_t feed_size, uint64_t nbytes, uint64_t npixels, uint64_t nfeeds, double seconds)
+{
+	printf("%s,%s,%u,%u,%u,%u,%zu,%llu,%llu,%llu,%.6f,%.2f,%.0f,%.1f\n",
+		op, format_names[img->format], img->maxval, img->width, img->height, img->comments,
+		feed_size, (unsigned long long)nbytes, (unsigned long long)npixels, (unsigned long long)nfeeds,
+		seconds, nbytes / seconds / 1e6, npixels / seconds,
+		(nfeeds > 0) ? seconds * 1e9 / nfeeds : 0.0);
+}
+
+static void
+bench_write (struct image *img)
+{
+	// The writer's time is that of writing into memory:
+	unsigned int n = 0;
+	double start = now(), seconds;
+
+	do {
+		free(img->data);
+		if (write_image(img) == false) {
+			fprintf(stderr, "Could not write %s image\n", format_names[img->format]);
+			exit(1);
+		}
+		n++;
+	} while ((seconds = now() - start) < MIN_SECONDS);
+
+	seconds /= n;
+	print_result("write", img, 0, img->nbytes, (uint64_t)img->width * img->height, 0, seconds);
+}
+
+static void
+bench_read (const struct image *img, size_t feed_size)
+{
+	// Decode the image, or its start if it takes too many buffers. The
+	// row callback counts the rows, so that little else is measured:
+	size_t limit = (img->nbytes / feed_size > MAX_FEEDS) ? feed_size * MAX_FEEDS : img->nbytes;
+	uint64_t nrows = 0, nfeeds = 0;
+	unsigned int n = 0;
+	struct pnmreader *pr;
+	double start = now(), seconds;
+
+	if ((pr = pnmreader_create_rows(NULL, NULL, NULL, got_row, &nrows)) == NULL) {
+		fprintf(stderr, "Could not allocate pnmreader\n");
+		exit(1);
+	}
+	do {
+		enum pnmreader_result res = PNMREADER_FEED_ME;
+
+		pnmreader_reset(pr);
+		for (size_t pos = 0; pos < limit && res == PNMREADER_FEED_ME; pos += feed_size) {
+			size_t len = (limit - pos < feed_size) ? limit - pos : feed_size;
+
+			res = pnmreader_feed(pr, img->data + pos, len);
+			nfeeds++;
+		}
+		if (res != PNMREADER_FEED_ME && res != PNMREADER_FINISHED) {
+			fprintf(stderr, "Could not decode %s image: %d\n", format_names[img->format], res);
+			exit(1);
+		}
+		n++;
+	} while ((seconds = now() - start) < MIN_SECONDS);
+
+	pnmreader_destroy(pr);
+	seconds /= n;
+	print_result("read", img, feed_size, limit, nrows * img->width / n, nfeeds / n, seconds);
+}
+
+int
+main (void)
+{
+	static const enum pnm_format formats[] = {
+		FORMAT_PBM_ASC, FORMAT_PGM_ASC, FORMAT_PPM_ASC,
+		FORMAT_PBM_BIN, FORMAT_PGM_BIN, FORMAT_PPM_BIN,
+	};
+	static const unsigned int maxvals[] = { 255, 65535 };
+
+	// A small image, a large one, and a small one behind a long header:
+	static const struct { unsigned int width, height, comments; } shapes[] = {
+		{ 64, 48, 0 },
+		{ 3000, 2000, 0 },
+		{ 64, 48, 10000 },
+	};
+
+	puts("op,format,maxval,width,height,comments,feed_size,bytes,pixels,feeds,seconds,mb_per_s,pixels_per_s,ns_per_feed");
+
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+		bool bitmap = (formats[f] == FORMAT_PBM_ASC || formats[f] == FORMAT_PBM_BIN);
+
+		for (size_t m = 0; m < (bitmap ? 1 : sizeof(maxvals) / sizeof(maxvals[0])); m++) {
+			for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+				struct image img = {
+					.format   = formats[f],
+					.maxval   = bitmap ? 1 : maxvals[m],
+					.width    = shapes[s].width,
+					.height   = shapes[s].height,
+					.comments = shapes[s].comments,
+					.data     = NULL,
+				};
+				// The writer adds no comments, so only time it
+				// on headers without them:
+				if (img.comments == 0) {
+					bench_write(&img);
+				}
+				else if (write_image(&img) == false || add_comments(&img) == false) {
+					fprintf(stderr, "Could not allocate image\n");
+					return 1;
+				}
+				for (size_t i = 0; i < sizeof(feed_sizes) / sizeof(feed_sizes[0]); i++) {
+					bench_read(&img, feed_sizes[i]);
+				}
+				free(img.data);
+				fflush(stdout);
+			}
+		}
+	}
+	return 0;
+}
@@ -17,6 +17,7 @@ got_format (enum pnm_format f, void *data)
 		case FORMAT_PGM_BIN: fputs("P2\n", stdout); format = FORMAT_PGM_ASC; break;
 		case FORMAT_PPM_ASC:
 		case FORMAT_PPM_BIN: fputs("P3\n", stdout); format = FORMAT_PPM_ASC; break;
+		case FORMAT_PAM: return false;
 	}
 	return true;
 }
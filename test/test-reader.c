@@ -1,7 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../pnmreader/pnmreader.h"
+#include "../pnmwriter/pnmwriter.h"
+#include "../pnmio/pnmio.h"
 
 struct test
 {
@@ -15,6 +24,15 @@ struct test
 	unsigned int maxval;
 	unsigned int *pixels;
 	enum pnmreader_result result;
+
+	// Samples per pixel of a PAM image:
+	unsigned int depth;
+
+	// Use the row callback instead of the pixel callback:
+	bool rows;
+
+	// Feed the image in chunks of this size; all at once when zero:
+	size_t feedsize;
 };
 
 static int ret = 0;
@@ -67,17 +85,51 @@ got_pixel (unsigned int col, unsigned int row, unsigned int r, unsigned int g, u
 	return true;
 }
 
+static bool
+got_row (unsigned int row, const void *samples, void *data)
+{
+	struct test *t = data;
+	unsigned int channels = (t->format == FORMAT_PAM) ? t->depth
+		: (t->format == FORMAT_PPM_ASC || t->format == FORMAT_PPM_BIN) ? 3 : 1;
+
+	for (unsigned int col = 0; col < t->width; col++) {
+		unsigned int r = (t->maxval > 255)
+			? ((const uint16_t *)samples)[col * channels]
+			: ((const uint8_t *)samples)[col * channels];
+
+		if (r != t->pixels[row * t->width + col]) {
+			printf("Fail: %s: rows: at (%u,%u): expected %u, got %u\n", t->name, col, row, t->pixels[row * t->width + col], r);
+			ret = 1;
+		}
+	}
+	return true;
+}
+
 static void
 run_test (struct test *test)
 {
 	struct pnmreader *pr;
 	enum pnmreader_result res;
+	size_t feedsize = (test->feedsize) ? test->feedsize : test->nbytes;
+
+	pr = (test->rows)
+		? pnmreader_create_rows(got_format, got_geometry, got_maxval, got_row, test)
+		: pnmreader_create(got_format, got_geometry, got_maxval, got_pixel, test);
 
-	if ((pr = pnmreader_create(got_format, got_geometry, got_maxval, got_pixel, test)) == NULL) {
+	if (pr == NULL) {
 		printf("Fail: %s: pnmreader_create: could not allocate pnmreader\n", test->name);
 		ret = 1;
+		return;
+	}
+	// Stop at the first result other than PNMREADER_FEED_ME, and check the
+	// last result, also if the input ran out:
+	res = PNMREADER_FEED_ME;
+	for (size_t pos = 0; pos < test->nbytes && res == PNMREADER_FEED_ME; pos += feedsize) {
+		size_t nbytes = (test->nbytes - pos < feedsize) ? test->nbytes - pos : feedsize;
+
+		res = pnmreader_feed(pr, test->image + pos, nbytes);
 	}
-	if ((res = pnmreader_feed(pr, test->image, test->nbytes)) != test->result) {
+	if (res != test->result) {
 		printf("Fail: %s: pnmreader_feed: expected %d, got %d\n", test->name, test->result, res);
 		ret = 1;
 	}
@@ -208,6 +260,1931 @@ test6 (void)
 	});
 }
 
+static void
+test7 (void)
+{
+	// Two-byte binary PPM, fed in chunks that straddle the samples,
+	// decoded with the row callback:
+	unsigned char image[] = {
+		'P', '6', '\n',
+		'2', ' ', '2', '\n',
+		'6', '5', '5', '3', '5', '\n',
+		0x90, 0x33, 0, 0, 0, 0, 0x78, 0x26, 0, 0, 0, 0,
+		0x75, 0x98, 0, 0, 0, 0, 0x32, 0x53, 0, 0, 0, 0 };
+
+	unsigned int pixels[] = {
+		0x9033, 0x7826, 0x7598, 0x3253
+	};
+	run_test(&(struct test) {
+		.image = (char *)image,
+		.nbytes = sizeof(image),
+		.name = "test7",
+		.width = 2,
+		.height = 2,
+		.format = FORMAT_PPM_BIN,
+		.maxval = 65535,
+		.pixels = pixels,
+		.result = PNMREADER_FINISHED,
+		.rows = true,
+		.feedsize = 5
+	});
+}
+
+static void
+test8 (void)
+{
+	// Plain PGM, decoded with the row callback one byte at a time:
+	char image[] = \
+		"P2\n"
+		"3 2 # comment\n"
+		"255\n"
+		"0 128 255\n"
+		"7 8 9\n";
+
+	unsigned int pixels[] = { 0, 128, 255, 7, 8, 9 };
+
+	run_test(&(struct test) {
+		.image = image,
+		.nbytes = sizeof(image) - 1,
+		.name = "test8",
+		.width = 3,
+		.height = 2,
+		.format = FORMAT_PGM_ASC,
+		.maxval = 255,
+		.pixels = pixels,
+		.result = PNMREADER_FINISHED,
+		.rows = true,
+		.feedsize = 1
+	});
+}
+
+static void
+test9 (void)
+{
+	// Plain PGM with long runs of whitespace, long comments and numbers
+	// with leading zeros, fed in chunks that cut through all of them:
+	char image[] = \
+		"P2\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\n"
+		"# This comment is long enough to span several vector loads.\r"
+		"3                                         2\n"
+		"000000000000065535\n"
+		"0 00000001#comment\r000000000000000100\n"
+		"65535 0000001234\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t 0000012\n";
+
+	unsigned int pixels[] = { 0, 1, 100, 65535, 1234, 12 };
+
+	run_test(&(struct test) {
+		.image = image,
+		.nbytes = sizeof(image) - 1,
+		.name = "test9",
+		.width = 3,
+		.height = 2,
+		.format = FORMAT_PGM_ASC,
+		.maxval = 65535,
+		.pixels = pixels,
+		.result = PNMREADER_FINISHED,
+		.feedsize = 7
+	});
+}
+
+struct stream
+{
+	unsigned int nimages;
+	unsigned int sum;
+};
+
+static bool
+stream_got_format (enum pnm_format format, void *data)
+{
+	((struct stream *)data)->nimages++;
+	return true;
+}
+
+static bool
+stream_got_pixel (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *data)
+{
+	((struct stream *)data)->sum += r + g + b;
+	return true;
+}
+
+static void
+test10 (void)
+{
+	// Three concatenated images, decoded in multi-image mode:
+	char image[] = \
+		"P2 2 1 255 1 2\n"
+		"# Comment between images\n"
+		"P5 1 1 255 \x03"
+		"P3 1 1 9 4 5 6\n";
+
+	struct stream stream = { 0 };
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+
+	if ((pr = pnmreader_create(stream_got_format, NULL, NULL, stream_got_pixel, &stream)) == NULL) {
+		printf("Fail: test10: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	pnmreader_set_multi(pr, true);
+
+	// Feed in three parts: the first ends in the comment between images,
+	// which counts as being between images, the second in the third image:
+	if ((res = pnmreader_feed(pr, image, 30)) != PNMREADER_FINISHED) {
+		printf("Fail: test10: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if ((res = pnmreader_feed(pr, image + 30, 25)) != PNMREADER_FEED_ME) {
+		printf("Fail: test10: pnmreader_feed: expected %d, got %d\n", PNMREADER_FEED_ME, res);
+		ret = 1;
+	}
+	if ((res = pnmreader_feed(pr, image + 55, sizeof(image) - 1 - 55)) != PNMREADER_FINISHED) {
+		printf("Fail: test10: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if (stream.nimages != 3 || stream.sum != 1 + 1 + 1 + 2 + 2 + 2 + 3 + 3 + 3 + 4 + 5 + 6) {
+		printf("Fail: test10: got %u images with sum %u\n", stream.nimages, stream.sum);
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+}
+
+static void
+test11 (void)
+{
+	// Two concatenated images, decoded by resetting the reader in between:
+	char image[] = \
+		"P5 2 1 255 \x01\x02"
+		"P2 1 1 255 3\n";
+
+	struct stream stream = { 0 };
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+	size_t consumed;
+
+	if ((pr = pnmreader_create(stream_got_format, NULL, NULL, stream_got_pixel, &stream)) == NULL) {
+		printf("Fail: test11: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	if ((res = pnmreader_feed(pr, image, sizeof(image) - 1)) != PNMREADER_FINISHED) {
+		printf("Fail: test11: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if ((consumed = pnmreader_get_consumed(pr)) != 13) {
+		printf("Fail: test11: consumed: expected 13, got %zu\n", consumed);
+		ret = 1;
+	}
+	pnmreader_reset(pr);
+	if ((res = pnmreader_feed(pr, image + consumed, sizeof(image) - 1 - consumed)) != PNMREADER_FINISHED) {
+		printf("Fail: test11: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if (stream.nimages != 2 || stream.sum != 3 + 6 + 9) {
+		printf("Fail: test11: got %u images with sum %u\n", stream.nimages, stream.sum);
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+}
+
+// A large image, generated on the fly:
+struct large
+{
+	char *image;
+	size_t nbytes;
+	enum pnm_format format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int maxval;
+	unsigned int channels;
+
+	// For each row, 1 if it was passed to the row callback with the right
+	// contents, 2 if its contents were wrong:
+	unsigned char *seen;
+};
+
+static unsigned int
+large_sample (struct large *l, unsigned int col, unsigned int row, unsigned int c)
+{
+	return (col * 7 + row * 13 + c * 101) % (l->maxval + 1);
+}
+
+static bool
+large_create (struct large *l, enum pnm_format format, unsigned int width, unsigned int height, unsigned int maxval)
+{
+	char *p;
+
+	l->format = format;
+	l->width = width;
+	l->height = height;
+	l->maxval = (format == FORMAT_PBM_ASC || format == FORMAT_PBM_BIN) ? 1 : maxval;
+	l->channels = (format == FORMAT_PPM_ASC || format == FORMAT_PPM_BIN) ? 3 : 1;
+
+	if ((l->image = malloc(64 + (size_t)height * (width * l->channels * 4 + 16))) == NULL) {
+		return false;
+	}
+	if ((l->seen = calloc(height, 1)) == NULL) {
+		free(l->image);
+		return false;
+	}
+	p = l->image + sprintf(l->image, "P%d\n# Large image\n%u %u\n", format, width, height);
+	if (l->maxval > 1) {
+		p += sprintf(p, "%u\n", l->maxval);
+	}
+	if (format == FORMAT_PBM_BIN) {
+		for (unsigned int row = 0; row < height; row++) {
+			memset(p, 0, (width + 7) / 8);
+			for (unsigned int col = 0; col < width; col++) {
+				p[col / 8] |= large_sample(l, col, row, 0) << (7 - col % 8);
+			}
+			p += (width + 7) / 8;
+		}
+		l->nbytes = p - l->image;
+		return true;
+	}
+	if (format == FORMAT_PGM_BIN || format == FORMAT_PPM_BIN) {
+		for (unsigned int row = 0; row < height; row++) {
+			for (unsigned int col = 0; col < width; col++) {
+				for (unsigned int c = 0; c < l->channels; c++) {
+					unsigned int v = large_sample(l, col, row, c);
+					if (l->maxval > 255) {
+						*p++ = v >> 8;
+					}
+					*p++ = v;
+				}
+			}
+		}
+		l->nbytes = p - l->image;
+		return true;
+	}
+	// Lines of varying length, with comments between some of the rows,
+	// and bitmap samples without separators:
+	for (unsigned int row = 0; row < height; row++) {
+		if (row % 5 == 0) {
+			p += sprintf(p, "# Comment\n");
+		}
+		for (unsigned int col = 0; col < width; col++) {
+			for (unsigned int c = 0; c < l->channels; c++) {
+				p += sprintf(p, "%u", large_sample(l, col, row, c));
+				if (format != FORMAT_PBM_ASC) {
+					*p++ = ((col * l->channels + c) % 17 == 16) ? '\n' : ' ';
+				}
+			}
+		}
+		if (format == FORMAT_PBM_ASC) {
+			*p++ = '\n';
+		}
+	}
+	l->nbytes = p - l->image;
+	return true;
+}
+
+static bool
+large_got_row (unsigned int row, const void *samples, void *data)
+{
+	struct large *l = data;
+
+	l->seen[row] = 1;
+	for (unsigned int i = 0; i < l->width * l->channels; i++) {
+		unsigned int v = (l->maxval > 255)
+			? ((const uint16_t *)samples)[i]
+			: ((const uint8_t *)samples)[i];
+
+		if (v != large_sample(l, i / l->channels, row, i % l->channels)) {
+			l->seen[row] = 2;
+		}
+	}
+	return true;
+}
+
+static enum pnmreader_result
+large_decode (struct large *l, size_t nbytes, unsigned int nthreads, size_t *consumed)
+{
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+
+	*consumed = 0;
+	if ((pr = pnmreader_create_rows(NULL, NULL, NULL, large_got_row, l)) == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	memset(l->seen, 0, l->height);
+	res = (nthreads > 0)
+		? pnmreader_feed_parallel(pr, l->image, nbytes, nthreads)
+		: pnmreader_feed(pr, l->image, nbytes);
+
+	*consumed = pnmreader_get_consumed(pr);
+	pnmreader_destroy(pr);
+	return res;
+}
+
+static enum pnmreader_result
+large_decode_split (struct large *l, size_t split, unsigned int nthreads)
+{
+	// Decode the image up to split in parallel, and the rest with
+	// pnmreader_feed(), as a caller would that reads a file in parts:
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+
+	if ((pr = pnmreader_create_rows(NULL, NULL, NULL, large_got_row, l)) == NULL) {
+		return PNMREADER_ABORTED;
+	}
+	memset(l->seen, 0, l->height);
+	if ((res = pnmreader_feed_parallel(pr, l->image, split, nthreads)) == PNMREADER_FEED_ME) {
+		res = (pnmreader_get_consumed(pr) == split)
+			? pnmreader_feed(pr, l->image + split, l->nbytes - split)
+			: PNMREADER_ABORTED;
+	}
+	pnmreader_destroy(pr);
+	return res;
+}
+
+static bool
+large_check_rows (struct large *l, const char *name, enum pnm_format format)
+{
+	for (unsigned int row = 0; row < l->height; row++) {
+		if (l->seen[row] != 1) {
+			printf("Fail: %s: P%d: row %u: %s\n", name, format, row, l->seen[row] ? "wrong contents" : "missing");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+test12 (void)
+{
+	// Decode large plain images in parallel:
+	const enum pnm_format formats[] = { FORMAT_PBM_ASC, FORMAT_PGM_ASC, FORMAT_PPM_ASC };
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		struct large l;
+		enum pnmreader_result res;
+		size_t consumed;
+
+		if (large_create(&l, formats[i], 1000, 300, 999) == false) {
+			printf("Fail: test12: could not allocate image\n");
+			ret = 1;
+			return;
+		}
+		if ((res = large_decode(&l, l.nbytes, 4, &consumed)) != PNMREADER_FINISHED) {
+			printf("Fail: test12: P%d: pnmreader_feed_parallel: expected %d, got %d\n", formats[i], PNMREADER_FINISHED, res);
+			ret = 1;
+		}
+		// The image ends with a single whitespace character:
+		if (consumed != l.nbytes - 1) {
+			printf("Fail: test12: P%d: consumed: expected %zu, got %zu\n", formats[i], l.nbytes - 1, consumed);
+			ret = 1;
+		}
+		for (unsigned int row = 0; row < l.height; row++) {
+			if (l.seen[row] != 1) {
+				printf("Fail: test12: P%d: row %u: %s\n", formats[i], row, l.seen[row] ? "wrong contents" : "missing");
+				ret = 1;
+				break;
+			}
+		}
+		free(l.seen);
+		free(l.image);
+	}
+}
+
+static void
+test13 (void)
+{
+	// Errors in large plain images are reported at the same offset as with
+	// sequential decoding:
+	struct large l;
+	enum pnmreader_result res[2];
+	size_t consumed[2];
+	size_t splits[3];
+	char *p;
+
+	if (large_create(&l, FORMAT_PGM_ASC, 1000, 300, 999) == false) {
+		printf("Fail: test13: could not allocate image\n");
+		ret = 1;
+		return;
+	}
+	// An invalid character in the middle of a number:
+	for (p = l.image + l.nbytes / 2; *p < '0' || *p > '9'; p++) {
+		continue;
+	}
+	*p = 'x';
+	for (unsigned int nthreads = 0; nthreads < 2; nthreads++) {
+		res[nthreads] = large_decode(&l, l.nbytes, nthreads * 4, &consumed[nthreads]);
+	}
+	if (res[0] != PNMREADER_INVALID_CHAR || res[1] != res[0] || consumed[0] != (size_t)(p - l.image) || consumed[1] != consumed[0]) {
+		printf("Fail: test13: invalid char at %zu: got %d at %zu, %d at %zu\n", (size_t)(p - l.image), res[0], consumed[0], res[1], consumed[1]);
+		ret = 1;
+	}
+	// A sample above the maxval:
+	*p = '0';
+	memcpy(l.image + 26, "899", 3);
+	for (unsigned int nthreads = 0; nthreads < 2; nthreads++) {
+		res[nthreads] = large_decode(&l, l.nbytes, nthreads * 4, &consumed[nthreads]);
+	}
+	if (res[0] != PNMREADER_INVALID_CHAR || res[1] != res[0] || consumed[1] != consumed[0]) {
+		printf("Fail: test13: out of range: got %d at %zu, %d at %zu\n", res[0], consumed[0], res[1], consumed[1]);
+		ret = 1;
+	}
+	// A truncated image:
+	memcpy(l.image + 26, "999", 3);
+	if ((res[1] = large_decode(&l, l.nbytes / 2, 4, &consumed[1])) != PNMREADER_FEED_ME) {
+		printf("Fail: test13: truncated: expected %d, got %d\n", PNMREADER_FEED_ME, res[1]);
+		ret = 1;
+	}
+	// The rest of a truncated image can be fed sequentially. Split inside
+	// a number, right after one, and right after the header:
+	for (p = l.image + l.nbytes / 2; p[-1] < '0' || p[-1] > '9' || *p < '0' || *p > '9'; p++) {
+		continue;
+	}
+	splits[0] = p - l.image;
+	for (p++; *p >= '0' && *p <= '9'; p++) {
+		continue;
+	}
+	splits[1] = p - l.image;
+	splits[2] = 20;
+
+	for (size_t i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+		if ((res[1] = large_decode_split(&l, splits[i], 4)) != PNMREADER_FINISHED) {
+			printf("Fail: test13: split at %zu: expected %d, got %d\n", splits[i], PNMREADER_FINISHED, res[1]);
+			ret = 1;
+		}
+		if (large_check_rows(&l, "test13", FORMAT_PGM_ASC) == false) {
+			ret = 1;
+		}
+	}
+	free(l.seen);
+	free(l.image);
+}
+
+static void
+test14 (void)
+{
+	// Decode large binary images in parallel, through the row callback
+	// and into a destination buffer:
+	const enum pnm_format formats[] = { FORMAT_PBM_BIN, FORMAT_PGM_BIN, FORMAT_PPM_BIN };
+	const unsigned int maxvals[] = { 1, 999, 255 };
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		struct large l;
+		struct pnmreader *pr;
+		enum pnmreader_result res;
+		size_t consumed;
+		size_t stride;
+		uint16_t *dest;
+
+		if (large_create(&l, formats[i], 1001, 300, maxvals[i]) == false) {
+			printf("Fail: test14: could not allocate image\n");
+			ret = 1;
+			return;
+		}
+		if ((res = large_decode(&l, l.nbytes, 4, &consumed)) != PNMREADER_FINISHED || consumed != l.nbytes) {
+			printf("Fail: test14: P%d: pnmreader_feed_parallel: expected %d at %zu, got %d at %zu\n", formats[i], PNMREADER_FINISHED, l.nbytes, res, consumed);
+			ret = 1;
+		}
+		for (unsigned int row = 0; row < l.height; row++) {
+			if (l.seen[row] != 1) {
+				printf("Fail: test14: P%d: row %u: %s\n", formats[i], row, l.seen[row] ? "wrong contents" : "missing");
+				ret = 1;
+				break;
+			}
+		}
+		// Split in the middle of a row and of a sample, and right after
+		// the header:
+		for (size_t split = l.nbytes / 2 + 1; split > 0; split = (split > 20) ? 20 : 0) {
+			if ((res = large_decode_split(&l, split, 4)) != PNMREADER_FINISHED) {
+				printf("Fail: test14: P%d: split at %zu: expected %d, got %d\n", formats[i], split, PNMREADER_FINISHED, res);
+				ret = 1;
+			}
+			if (large_check_rows(&l, "test14", formats[i]) == false) {
+				ret = 1;
+			}
+		}
+		// Rows are two samples longer than needed:
+		stride = (l.width * l.channels + 2) * ((l.maxval > 255) ? 2 : 1);
+		if ((dest = malloc(stride * l.height)) == NULL || (pr = pnmreader_create(NULL, NULL, NULL, NULL, NULL)) == NULL) {
+			printf("Fail: test14: could not allocate pnmreader\n");
+			ret = 1;
+			free(dest);
+			free(l.seen);
+			free(l.image);
+			return;
+		}
+		pnmreader_set_dest(pr, dest, stride);
+		if ((res = pnmreader_feed_parallel(pr, l.image, l.nbytes, 4)) != PNMREADER_FINISHED) {
+			printf("Fail: test14: P%d: pnmreader_feed_parallel: expected %d, got %d\n", formats[i], PNMREADER_FINISHED, res);
+			ret = 1;
+		}
+		for (unsigned int row = 0; row < l.height; row++) {
+			large_got_row(row, (char *)dest + row * stride, &l);
+			if (l.seen[row] != 1) {
+				printf("Fail: test14: P%d: destination row %u: wrong contents\n", formats[i], row);
+				ret = 1;
+				break;
+			}
+		}
+		pnmreader_destroy(pr);
+		free(dest);
+		free(l.seen);
+		free(l.image);
+	}
+}
+
+struct rowlog
+{
+	unsigned int nrows;
+	unsigned int rows[8];
+	unsigned int first[8];
+};
+
+static bool
+rowlog_got_row (unsigned int row, const void *samples, void *data)
+{
+	struct rowlog *log = data;
+
+	if (log->nrows < 8) {
+		log->rows[log->nrows] = row;
+		log->first[log->nrows] = ((const uint8_t *)samples)[0];
+		log->nrows++;
+	}
+	return true;
+}
+
+static void
+test15 (void)
+{
+	// Seek to rows of a binary image, and skip to rows without seeking:
+	char image[] = \
+		"P5 2 6 255\n"
+		"\x00\x01" "\x10\x11" "\x20\x21" "\x30\x31" "\x40\x41" "\x50\x51";
+
+	struct rowlog log = { 0 };
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+	uint64_t offset;
+
+	if ((pr = pnmreader_create_rows(NULL, NULL, NULL, rowlog_got_row, &log)) == NULL) {
+		printf("Fail: test15: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	if (pnmreader_row_offset(pr, 0, &offset) == true) {
+		printf("Fail: test15: got row offset before header\n");
+		ret = 1;
+	}
+	// Feed the header and the first row:
+	if ((res = pnmreader_feed(pr, image, 13)) != PNMREADER_FEED_ME) {
+		printf("Fail: test15: pnmreader_feed: expected %d, got %d\n", PNMREADER_FEED_ME, res);
+		ret = 1;
+	}
+	if (pnmreader_row_offset(pr, 4, &offset) == false || offset != 19) {
+		printf("Fail: test15: row offset: expected 19\n");
+		ret = 1;
+	}
+	if (pnmreader_row_offset(pr, 6, &offset) == true) {
+		printf("Fail: test15: got row offset past the end\n");
+		ret = 1;
+	}
+	// Seek to row 4, then back to row 1:
+	if (pnmreader_seek_row(pr, 4) == false) {
+		printf("Fail: test15: could not seek to row 4\n");
+		ret = 1;
+	}
+	if ((res = pnmreader_feed(pr, image + 19, 4)) != PNMREADER_FINISHED) {
+		printf("Fail: test15: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if (pnmreader_seek_row(pr, 1) == false) {
+		printf("Fail: test15: could not seek to row 1\n");
+		ret = 1;
+	}
+	if ((res = pnmreader_feed(pr, image + 13, 2)) != PNMREADER_FEED_ME) {
+		printf("Fail: test15: pnmreader_feed: expected %d, got %d\n", PNMREADER_FEED_ME, res);
+		ret = 1;
+	}
+	// Skip from row 2 to row 5 while feeding the rest of the data:
+	if (pnmreader_skip_to_row(pr, 1) == true) {
+		printf("Fail: test15: could skip backwards\n");
+		ret = 1;
+	}
+	if (pnmreader_skip_to_row(pr, 5) == false) {
+		printf("Fail: test15: could not skip to row 5\n");
+		ret = 1;
+	}
+	if ((res = pnmreader_feed(pr, image + 15, 4)) != PNMREADER_FEED_ME) {
+		printf("Fail: test15: pnmreader_feed: expected %d, got %d\n", PNMREADER_FEED_ME, res);
+		ret = 1;
+	}
+	if ((res = pnmreader_feed(pr, image + 19, 4)) != PNMREADER_FINISHED) {
+		printf("Fail: test15: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if (pnmreader_get_consumed(pr) != 4) {
+		printf("Fail: test15: consumed: expected 4, got %zu\n", pnmreader_get_consumed(pr));
+		ret = 1;
+	}
+	if (log.nrows != 5
+	 || log.rows[0] != 0 || log.rows[1] != 4 || log.rows[2] != 5 || log.rows[3] != 1 || log.rows[4] != 5
+	 || log.first[0] != 0x00 || log.first[1] != 0x40 || log.first[2] != 0x50 || log.first[3] != 0x10 || log.first[4] != 0x50) {
+		printf("Fail: test15: got %u rows, not in the expected order\n", log.nrows);
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+}
+
+static void
+test16 (void)
+{
+	// Decode a region of interest from a binary and a plain image, fed
+	// whole and byte by byte:
+	char image[] = \
+		"P5 4 4 255\n"
+		"\x00\x01\x02\x03" "\x10\x11\x12\x13" "\x20\x21\x22\x23" "\x30\x31\x32\x33"
+		"P2 4 2 9\n"
+		"0 1 2 3\n"
+		"4 5 6 7\n";
+
+	size_t nbytes = sizeof(image) - 1;
+	size_t chunks[] = { nbytes, 1 };
+
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		size_t chunk = chunks[c];
+		struct rowlog log = { 0 };
+		struct pnmreader *pr;
+		enum pnmreader_result res = PNMREADER_FEED_ME;
+
+		if ((pr = pnmreader_create_rows(NULL, NULL, NULL, rowlog_got_row, &log)) == NULL) {
+			printf("Fail: test16: pnmreader_create: could not allocate pnmreader\n");
+			ret = 1;
+			return;
+		}
+		if (pnmreader_set_roi(pr, 1, 1, 0, 2) == true) {
+			printf("Fail: test16: accepted empty region\n");
+			ret = 1;
+		}
+		pnmreader_set_roi(pr, 1, 1, 2, 2);
+		pnmreader_set_multi(pr, true);
+
+		for (size_t i = 0; i < nbytes; i += chunk) {
+			size_t n = (nbytes - i < chunk) ? nbytes - i : chunk;
+
+			res = pnmreader_feed(pr, image + i, n);
+		}
+		if (res != PNMREADER_FINISHED) {
+			printf("Fail: test16: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+			ret = 1;
+		}
+		// The plain image only has one row in the region:
+		if (log.nrows != 3
+		 || log.rows[0] != 1 || log.rows[1] != 2 || log.rows[2] != 1
+		 || log.first[0] != 0x11 || log.first[1] != 0x21 || log.first[2] != 5) {
+			printf("Fail: test16: got %u rows, not the region of interest\n", log.nrows);
+			ret = 1;
+		}
+		pnmreader_destroy(pr);
+	}
+}
+
+static void
+test17 (void)
+{
+	// Two-byte PAM with gray and alpha, with the header fields in an
+	// unusual order, decoded with the row callback one byte at a time:
+	unsigned char image[] = \
+		"P7\n"
+		"# comment\n"
+		"TUPLTYPE GRAYSCALE_ALPHA\n"
+		"MAXVAL 1000\n"
+		"DEPTH 2\n"
+		"HEIGHT 2\tWIDTH 2\n"
+		"ENDHDR\n"
+		"\x03\xE8\x00\x01" "\x00\x02\x00\x03"
+		"\x00\x04\x00\x05" "\x01\x00\x00\x07";
+
+	unsigned int pixels[] = { 1000, 2, 4, 256 };
+
+	run_test(&(struct test) {
+		.image = (char *)image,
+		.nbytes = sizeof(image) - 1,
+		.name = "test17",
+		.width = 2,
+		.height = 2,
+		.format = FORMAT_PAM,
+		.maxval = 1000,
+		.depth = 2,
+		.pixels = pixels,
+		.result = PNMREADER_FINISHED,
+		.rows = true,
+		.feedsize = 1,
+	});
+}
+
+static bool
+test18_got_row (unsigned int row, const void *samples, void *data)
+{
+	// Keep the alpha sample of the last pixel:
+	*(unsigned int *)data = ((const uint8_t *)samples)[7];
+	return true;
+}
+
+static void
+test18 (void)
+{
+	// PAM depth and tuple type, samples past the third, and bad headers:
+	char image[] = \
+		"P7\n"
+		"WIDTH 2\n"
+		"HEIGHT 1\n"
+		"DEPTH 4\n"
+		"MAXVAL 255\n"
+		"TUPLTYPE RGB_ALPHA\n"
+		"ENDHDR\n"
+		"\x01\x02\x03\x04" "\x05\x06\x07\x08";
+
+	char *bad[] = {
+		"P7\nWIDTH 2\nHEIGHT 1\nMAXVAL 255\nENDHDR\n",
+		"P7\nWIDTH 2\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\nCOLORS 3\nENDHDR\n",
+		"P7\nWIDTH 2\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\nENDHDR x\n",
+	};
+	enum pnmreader_result expect[] = {
+		PNMREADER_UNSUPPORTED,
+		PNMREADER_INVALID_CHAR,
+		PNMREADER_INVALID_CHAR,
+	};
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+	const char *tupltype;
+	unsigned int depth;
+	unsigned int alpha = 0;
+
+	if ((pr = pnmreader_create_rows(NULL, NULL, NULL, test18_got_row, &alpha)) == NULL) {
+		printf("Fail: test18: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	if ((res = pnmreader_feed(pr, image, sizeof(image) - 1)) != PNMREADER_FINISHED) {
+		printf("Fail: test18: pnmreader_feed: expected %d, got %d\n", PNMREADER_FINISHED, res);
+		ret = 1;
+	}
+	if (pnmreader_get_depth(pr, &depth) == false || depth != 4) {
+		printf("Fail: test18: depth: expected 4\n");
+		ret = 1;
+	}
+	if (pnmreader_get_tupltype(pr, &tupltype) == false || strcmp(tupltype, "RGB_ALPHA") != 0) {
+		printf("Fail: test18: tuple type: expected RGB_ALPHA\n");
+		ret = 1;
+	}
+	if (alpha != 8) {
+		printf("Fail: test18: alpha: expected 8, got %u\n", alpha);
+		ret = 1;
+	}
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		pnmreader_reset(pr);
+		if ((res = pnmreader_feed(pr, bad[i], strlen(bad[i]))) != expect[i]) {
+			printf("Fail: test18: bad header %zu: expected %d, got %d\n", i, expect[i], res);
+			ret = 1;
+		}
+	}
+	pnmreader_destroy(pr);
+}
+
+static void
+test19 (void)
+{
+	// Probe the header of a regular file and of a pipe:
+	char image[] = "P5 # comment\n3 2\n65535\n" "abcdefghijkl";
+	size_t hdrsize = sizeof(image) - 1 - 12;
+	struct pnmreader_probe probe;
+	enum pnmreader_result res;
+	char raster[12];
+	FILE *f;
+	int fds[2];
+
+	if ((f = tmpfile()) == NULL || fwrite(image, 1, sizeof(image) - 2, f) != sizeof(image) - 2 || fflush(f) != 0) {
+		printf("Fail: test19: could not write temporary file\n");
+		ret = 1;
+		return;
+	}
+	// The file is one byte short:
+	rewind(f);
+	if ((res = pnmreader_probe_fd(fileno(f), &probe)) != PNMREADER_FEED_ME) {
+		printf("Fail: test19: truncated file: expected %d, got %d\n", PNMREADER_FEED_ME, res);
+		ret = 1;
+	}
+	fseek(f, 0, SEEK_END);
+	fwrite(image + sizeof(image) - 2, 1, 1, f);
+	fflush(f);
+	rewind(f);
+	if ((res = pnmreader_probe_fd(fileno(f), &probe)) != PNMREADER_SUCCESS) {
+		printf("Fail: test19: file: expected %d, got %d\n", PNMREADER_SUCCESS, res);
+		ret = 1;
+	}
+	else if (probe.format != FORMAT_PGM_BIN || probe.width != 3 || probe.height != 2
+	      || probe.maxval != 65535 || probe.depth != 1
+	      || probe.header_size != hdrsize || probe.raster_size != 12) {
+		printf("Fail: test19: file: wrong header\n");
+		ret = 1;
+	}
+	fclose(f);
+
+	// Probing a pipe leaves the raster unread:
+	if (pipe(fds) != 0 || write(fds[1], image, sizeof(image) - 1) != sizeof(image) - 1) {
+		printf("Fail: test19: could not write pipe\n");
+		ret = 1;
+		return;
+	}
+	close(fds[1]);
+	if ((res = pnmreader_probe_fd(fds[0], &probe)) != PNMREADER_SUCCESS) {
+		printf("Fail: test19: pipe: expected %d, got %d\n", PNMREADER_SUCCESS, res);
+		ret = 1;
+	}
+	else if (probe.header_size != hdrsize || probe.raster_size != 12) {
+		printf("Fail: test19: pipe: wrong header\n");
+		ret = 1;
+	}
+	if (read(fds[0], raster, sizeof(raster)) != sizeof(raster) || memcmp(raster, image + hdrsize, sizeof(raster)) != 0) {
+		printf("Fail: test19: pipe: raster not left unread\n");
+		ret = 1;
+	}
+	close(fds[0]);
+}
+
+static void
+test20 (void)
+{
+	// Decode into typed buffers, feeding the planar case byte by byte:
+	char color[] = "P3 2 2 15  15 0 0  0 15 0  0 0 15  15 15 15 ";
+	char bitmap[] = "P1 3 1 1 0 1 ";
+	const uint16_t expect_planar[3][2][4] = {
+		{ { 65535, 0 }, { 0, 65535 } },
+		{ { 0, 65535 }, { 0, 65535 } },
+		{ { 0, 0 }, { 65535, 65535 } },
+	};
+	const uint8_t expect_gray[2][3] = { { 77, 149 }, { 29, 255 } };
+	const uint8_t expect_bitmap[3] = { 0, 255, 0 };
+	uint16_t planar[3][2][4];
+	uint8_t gray[2][3];
+	uint8_t bits[3];
+	struct pnmreader *pr;
+	enum pnmreader_result res = PNMREADER_FEED_ME;
+
+	if ((pr = pnmreader_create(NULL, NULL, NULL, NULL, NULL)) == NULL) {
+		printf("Fail: test20: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	memset(planar, 0, sizeof(planar));
+	pnmreader_decode_into(pr, planar, sizeof(planar[0][0]), PNMREADER_UINT16 | PNMREADER_RGB | PNMREADER_PLANAR);
+	for (size_t i = 0; i < sizeof(color) - 1 && res == PNMREADER_FEED_ME; i++) {
+		res = pnmreader_feed(pr, color + i, 1);
+	}
+	if (res != PNMREADER_FINISHED || memcmp(planar, expect_planar, sizeof(planar)) != 0) {
+		printf("Fail: test20: planar RGB: wrong result or contents\n");
+		ret = 1;
+	}
+	pnmreader_reset(pr);
+	memset(gray, 0, sizeof(gray));
+	pnmreader_decode_into(pr, gray, sizeof(gray[0]), PNMREADER_UINT8 | PNMREADER_GRAY);
+	if (pnmreader_feed(pr, color, sizeof(color) - 1) != PNMREADER_FINISHED || memcmp(gray, expect_gray, sizeof(gray)) != 0) {
+		printf("Fail: test20: gray: wrong result or contents\n");
+		ret = 1;
+	}
+	pnmreader_reset(pr);
+	pnmreader_decode_into(pr, bits, sizeof(bits), PNMREADER_UINT8 | PNMREADER_GRAY);
+	if (pnmreader_feed(pr, bitmap, sizeof(bitmap) - 1) != PNMREADER_FINISHED || memcmp(bits, expect_bitmap, sizeof(bits)) != 0) {
+		printf("Fail: test20: bitmap: wrong result or contents\n");
+		ret = 1;
+	}
+	// A stride that is too small for a row:
+	pnmreader_reset(pr);
+	pnmreader_decode_into(pr, gray, 1, PNMREADER_UINT8 | PNMREADER_GRAY);
+	if ((res = pnmreader_feed(pr, color, sizeof(color) - 1)) != PNMREADER_UNSUPPORTED) {
+		printf("Fail: test20: small stride: expected %d, got %d\n", PNMREADER_UNSUPPORTED, res);
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+}
+
+static void
+test21 (void)
+{
+	// Pull rows in batches, from one buffer and from a row split over two:
+	char plain[] = "P2 3 3 9 1 2 3 4 5 6 7 8 9 ";
+	char binary[] = "P5 4 3 255\n" "abcd" "efgh" "ijkl";
+	const size_t split = 11 + 6;
+	uint8_t rows[2][4];
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+	unsigned int nrows;
+
+	if ((pr = pnmreader_create(NULL, NULL, NULL, NULL, NULL)) == NULL) {
+		printf("Fail: test21: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	pnmreader_set_input(pr, plain, sizeof(plain) - 1);
+	if ((res = pnmreader_next_rows(pr, rows, sizeof(rows[0]), 2, &nrows)) != PNMREADER_SUCCESS || nrows != 2
+	 || rows[0][0] != 1 || rows[1][2] != 6) {
+		printf("Fail: test21: plain: first batch: got %d with %u rows\n", res, nrows);
+		ret = 1;
+	}
+	if ((res = pnmreader_next_rows(pr, rows, sizeof(rows[0]), 2, &nrows)) != PNMREADER_FINISHED || nrows != 1
+	 || rows[0][0] != 7 || rows[0][2] != 9) {
+		printf("Fail: test21: plain: second batch: got %d with %u rows\n", res, nrows);
+		ret = 1;
+	}
+	pnmreader_reset(pr);
+	pnmreader_set_input(pr, binary, split);
+	if ((res = pnmreader_next_rows(pr, rows, sizeof(rows[0]), 2, &nrows)) != PNMREADER_FEED_ME || nrows != 1
+	 || memcmp(rows[0], "abcd", 4) != 0) {
+		printf("Fail: test21: binary: first buffer: got %d with %u rows\n", res, nrows);
+		ret = 1;
+	}
+	pnmreader_set_input(pr, binary + split, sizeof(binary) - 1 - split);
+	if ((res = pnmreader_next_rows(pr, rows, sizeof(rows[0]), 2, &nrows)) != PNMREADER_FINISHED || nrows != 2
+	 || memcmp(rows[0], "efgh", 4) != 0 || memcmp(rows[1], "ijkl", 4) != 0) {
+		printf("Fail: test21: binary: second buffer: got %d with %u rows\n", res, nrows);
+		ret = 1;
+	}
+	// A stride that is too small for a row:
+	pnmreader_reset(pr);
+	pnmreader_set_input(pr, binary, sizeof(binary) - 1);
+	if ((res = pnmreader_next_rows(pr, rows, 3, 2, &nrows)) != PNMREADER_UNSUPPORTED) {
+		printf("Fail: test21: small stride: expected %d, got %d\n", PNMREADER_UNSUPPORTED, res);
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+}
+
+static void
+test22 (void)
+{
+	// Counters, split inside a number and inside a binary pixel. Without
+	// PNMREADER_STATS, there are none:
+	char plain[] = "P2 2 1 255 10 200\n";
+	struct stream s = { 0, 0 };
+	struct pnmreader_stats stats;
+	struct pnmreader *pr;
+
+	if ((pr = pnmreader_create(stream_got_format, NULL, NULL, stream_got_pixel, &s)) == NULL) {
+		printf("Fail: test22: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+#if defined(PNMREADER_STATS)
+	char binary[] = "P5 2 1 65535\n" "\x01\x02\x03\x04";
+
+	pnmreader_feed(pr, plain, 15);
+	pnmreader_feed(pr, plain + 15, sizeof(plain) - 1 - 15);
+	if (pnmreader_get_stats(pr, &stats) == false) {
+		printf("Fail: test22: plain: no stats\n");
+		ret = 1;
+	}
+	else if (stats.bytes_header + stats.bytes_plain != sizeof(plain) - 2 || stats.bytes_binary != 0
+	      || stats.feeds != 2 || stats.split_tokens != 1 || stats.split_pixels != 0
+	      || stats.header_callbacks != 1 || stats.pixel_callbacks != 2 || stats.row_callbacks != 0) {
+		printf("Fail: test22: plain: unexpected counters\n");
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+
+	if ((pr = pnmreader_create(NULL, NULL, NULL, stream_got_pixel, &s)) == NULL) {
+		printf("Fail: test22: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	pnmreader_feed(pr, binary, 14);
+	pnmreader_feed(pr, binary + 14, sizeof(binary) - 1 - 14);
+	if (pnmreader_get_stats(pr, &stats) == false) {
+		printf("Fail: test22: binary: no stats\n");
+		ret = 1;
+	}
+	else if (stats.bytes_header + stats.bytes_binary != sizeof(binary) - 1 || stats.bytes_plain != 0
+	      || stats.feeds != 2 || stats.split_tokens != 0 || stats.split_pixels != 1
+	      || stats.header_callbacks != 0 || stats.pixel_callbacks != 2) {
+		printf("Fail: test22: binary: unexpected counters\n");
+		ret = 1;
+	}
+#else
+	pnmreader_feed(pr, plain, sizeof(plain) - 1);
+	if (pnmreader_get_stats(pr, &stats) != false) {
+		printf("Fail: test22: stats without PNMREADER_STATS\n");
+		ret = 1;
+	}
+#endif
+	pnmreader_destroy(pr);
+}
+
+static void
+test23 (void)
+{
+	// Feed a plain image from a pipe that stays open after it, and one
+	// from a file that takes several read buffers:
+	char image[] = "P2 2 1 255 10 200\n";
+	const unsigned int width = 1000, height = 1000;
+	struct stream s = { 0, 0 };
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+	FILE *f;
+	int fds[2];
+
+	if ((pr = pnmreader_create(stream_got_format, NULL, NULL, stream_got_pixel, &s)) == NULL) {
+		printf("Fail: test23: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	if (pipe(fds) != 0 || write(fds[1], image, sizeof(image) - 1) != sizeof(image) - 1) {
+		printf("Fail: test23: could not write pipe\n");
+		ret = 1;
+		pnmreader_destroy(pr);
+		return;
+	}
+	if ((res = pnmio_feed_fd(pr, fds[0])) != PNMREADER_FINISHED || s.sum != 3 * 210) {
+		printf("Fail: test23: pipe: got %d, sum %u\n", res, s.sum);
+		ret = 1;
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	if ((f = tmpfile()) == NULL) {
+		printf("Fail: test23: could not create temporary file\n");
+		ret = 1;
+		pnmreader_destroy(pr);
+		return;
+	}
+	fprintf(f, "P2\n%u %u\n65535\n", width, height);
+	for (unsigned int i = 0; i < width * height; i++) {
+		fprintf(f, "%u\n", i % 2);
+	}
+	fflush(f);
+	rewind(f);
+
+	pnmreader_reset(pr);
+	s.sum = 0;
+	if ((res = pnmio_feed_fd(pr, fileno(f))) != PNMREADER_FINISHED || s.sum != 3 * width * height / 2) {
+		printf("Fail: test23: file: got %d, sum %u\n", res, s.sum);
+		ret = 1;
+	}
+	fclose(f);
+	pnmreader_destroy(pr);
+}
+
+static void
+test24 (void)
+{
+	// Header numbers that do not fit in 32 bits, a raster of more than 64
+	// bits, and row offsets past 4 GiB:
+	static const struct {
+		const char *image;
+		enum pnmreader_result result;
+	} tests[] = {
+		{ "P2 4294967297 1 255\n",	PNMREADER_UNSUPPORTED },
+		{ "P2 1 4294967295 255\n",	PNMREADER_UNSUPPORTED },
+		{ "P2 1 1 4294967551\n",	PNMREADER_UNSUPPORTED },
+		{ "P2 1 1 255\n4294967296\n",	PNMREADER_INVALID_CHAR },
+		{ "P7\nWIDTH 4294967294\nHEIGHT 4294967294\nDEPTH 65535\nMAXVAL 65535\nENDHDR\n", PNMREADER_UNSUPPORTED },
+		{ "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 18446744073709551617\nMAXVAL 1\nENDHDR\n", PNMREADER_UNSUPPORTED },
+	};
+	char large[] = "P5 100000 100000 65535\n";
+	struct pnmreader *pr;
+	enum pnmreader_result res;
+	uint64_t offset;
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		char buf[100];
+
+		if ((pr = pnmreader_create(NULL, NULL, NULL, NULL, NULL)) == NULL) {
+			printf("Fail: test24: pnmreader_create: could not allocate pnmreader\n");
+			ret = 1;
+			return;
+		}
+		strcpy(buf, tests[i].image);
+		if ((res = pnmreader_feed(pr, buf, strlen(buf))) != tests[i].result) {
+			printf("Fail: test24: image %zu: expected %d, got %d\n", i, tests[i].result, res);
+			ret = 1;
+		}
+		pnmreader_destroy(pr);
+	}
+	if ((pr = pnmreader_create(NULL, NULL, NULL, NULL, NULL)) == NULL) {
+		printf("Fail: test24: pnmreader_create: could not allocate pnmreader\n");
+		ret = 1;
+		return;
+	}
+	if ((res = pnmreader_feed(pr, large, sizeof(large) - 1)) != PNMREADER_FEED_ME) {
+		printf("Fail: test24: large: expected %d, got %d\n", PNMREADER_FEED_ME, res);
+		ret = 1;
+	}
+	if (pnmreader_row_offset(pr, 99999, &offset) == false || offset != sizeof(large) - 1 + 99999ULL * 200000) {
+		printf("Fail: test24: large: wrong row offset\n");
+		ret = 1;
+	}
+	pnmreader_destroy(pr);
+}
+
+static void
+test25 (void)
+{
+	// Samples left of the region of interest are out of range. Binary
+	// rasters skip them unchecked, whether fed whole or byte by byte:
+	char image[] = \
+		"P6 2 1 100\n"
+		"\xc8\x01\x01" "\x02\x02\x02"
+		"P7\nWIDTH 2\nHEIGHT 1\nDEPTH 2\nMAXVAL 100\nENDHDR\n"
+		"\xc8\xc8" "\x03\x04"
+		"P7\nWIDTH 2\nHEIGHT 1\nDEPTH 1\nMAXVAL 1000\nENDHDR\n"
+		"\xff\xff" "\x01\x01";
+
+	size_t nbytes = sizeof(image) - 1;
+	size_t chunks[] = { nbytes, 1 };
+
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		size_t chunk = chunks[c];
+		struct rowlog log = { 0 };
+		struct pnmreader *pr;
+		enum pnmreader_result res = PNMREADER_FEED_ME;
+
+		if ((pr = pnmreader_create_rows(NULL, NULL, NULL, rowlog_got_row, &log)) == NULL) {
+			printf("Fail: test25: pnmreader_create: could not allocate pnmreader\n");
+			ret = 1;
+			return;
+		}
+		pnmreader_set_roi(pr, 1, 0, 1, 1);
+		pnmreader_set_multi(pr, true);
+
+		for (size_t i = 0; i < nbytes && (res == PNMREADER_FEED_ME || res == PNMREADER_FINISHED); i += chunk) {
+			size_t n = (nbytes - i < chunk) ? nbytes - i : chunk;
+
+			res = pnmreader_feed(pr, image + i, n);
+		}
+		if (res != PNMREADER_FINISHED) {
+			printf("Fail: test25: chunk %zu: expected %d, got %d\n", chunk, PNMREADER_FINISHED, res);
+			ret = 1;
+		}
+		if (log.nrows != 3 || log.first[0] != 2 || log.first[1] != 3 || log.first[2] != 1) {
+			printf("Fail: test25: chunk %zu: got %u rows, not the region of interest\n", chunk, log.nrows);
+			ret = 1;
+		}
+		pnmreader_destroy(pr);
+	}
+}
+
+static uint32_t
+random_sample (uint32_t *seed, unsigned int maxval)
+{
+	// Xorshift, good enough for test images:
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed % (maxval + 1);
+}
+
+static struct pnmwriter *
+writer_mem (enum pnm_format format, unsigned int width, unsigned int height, unsigned int maxval)
+{
+	// Create a memory writer with the given header:
+	struct pnmwriter *pw;
+
+	if ((pw = pnmwriter_create_mem()) == NULL) {
+		return NULL;
+	}
+	if (pnmwriter_format(pw, format) == false
+	 || pnmwriter_width(pw, width) == false
+	 || pnmwriter_height(pw, height) == false
+	 || pnmwriter_maxval(pw, maxval) == false) {
+		pnmwriter_destroy(pw);
+		return NULL;
+	}
+	return pw;
+}
+
+static void
+test26 (void)
+{
+	// Format plain images on several threads, in batches of rows, and
+	// compare with the sequential output. The images are large enough to
+	// be split over four threads, with and without a line break per row:
+	static const struct {
+		enum pnm_format format;
+		unsigned int width;
+		unsigned int maxval;
+	} tests[] = {
+		{ FORMAT_PBM_ASC, 9,    1     },
+		{ FORMAT_PBM_ASC, 1000, 1     },
+		{ FORMAT_PGM_ASC, 10,   255   },
+		{ FORMAT_PGM_ASC, 1000, 255   },
+		{ FORMAT_PGM_ASC, 10,   1000  },
+		{ FORMAT_PGM_ASC, 1000, 65535 },
+		{ FORMAT_PPM_ASC, 8,    255   },
+		{ FORMAT_PPM_ASC, 500,  255   },
+		{ FORMAT_PPM_ASC, 12,   1000  },
+		{ FORMAT_PPM_ASC, 500,  65535 },
+	};
+	uint32_t seed = 1;
+
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		const unsigned int depth = (tests[t].format == FORMAT_PPM_ASC) ? 3 : 1;
+		const size_t samplesize = (tests[t].maxval > 255) ? 2 : 1;
+		const size_t stride = (size_t)tests[t].width * depth * samplesize;
+		const unsigned int height = 600000 / (tests[t].width * depth) + 1;
+		const unsigned int batches[] = { height * 2 / 5, 1, height - height * 2 / 5 - 1 };
+		struct pnmwriter *pw;
+		char *samples, *seq = NULL, *par = NULL;
+		size_t seqlen, parlen;
+		unsigned int row = 0;
+
+		if ((samples = malloc(stride * height)) == NULL) {
+			printf("Fail: test26: could not allocate image\n");
+			ret = 1;
+			return;
+		}
+		for (size_t i = 0; i < (size_t)height * tests[t].width * depth; i++) {
+			if (samplesize == 1) {
+				((uint8_t *)samples)[i] = random_sample(&seed, tests[t].maxval);
+			}
+			else {
+				((uint16_t *)samples)[i] = random_sample(&seed, tests[t].maxval);
+			}
+		}
+		if ((pw = writer_mem(tests[t].format, tests[t].width, height, tests[t].maxval)) != NULL) {
+			if (pnmwriter_rows(pw, samples, stride, height)) {
+				seq = pnmwriter_take_mem(pw, &seqlen);
+			}
+			pnmwriter_destroy(pw);
+		}
+		if ((pw = writer_mem(tests[t].format, tests[t].width, height, tests[t].maxval)) != NULL) {
+			for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+				if (pnmwriter_rows_parallel(pw, samples + row * stride, stride, batches[b], 4) == false) {
+					break;
+				}
+				row += batches[b];
+			}
+			par = pnmwriter_take_mem(pw, &parlen);
+			pnmwriter_destroy(pw);
+		}
+		if (seq == NULL || par == NULL) {
+			printf("Fail: test26: image %zu: could not write\n", t);
+			ret = 1;
+		}
+		else if (parlen != seqlen || memcmp(par, seq, seqlen) != 0) {
+			printf("Fail: test26: image %zu: parallel output differs\n", t);
+			ret = 1;
+		}
+		free(samples);
+		free(seq);
+		free(par);
+	}
+}
+
+struct sink
+{
+	char data[512];
+	size_t nbytes;
+	unsigned int ncalls;
+	bool fail;
+};
+
+static bool
+sink_output (const void *data, size_t nbytes, void *userdata)
+{
+	// Collect the output, or fail when asked to:
+	struct sink *sink = userdata;
+
+	sink->ncalls++;
+	if (sink->fail || nbytes > sizeof(sink->data) - sink->nbytes) {
+		return false;
+	}
+	memcpy(sink->data + sink->nbytes, data, nbytes);
+	sink->nbytes += nbytes;
+	return true;
+}
+
+static void
+test27 (void)
+{
+	// Write the same image to memory, a file descriptor and a callback,
+	// and make a callback fail:
+	const char expect[] = "P5\n4 3\n255\n" "\x00\x01\x02\x03" "\x10\x11\x12\x13" "\x20\x21\x22\x23";
+	const uint8_t samples[] = {
+		0x00, 0x01, 0x02, 0x03,
+		0x10, 0x11, 0x12, 0x13,
+		0x20, 0x21, 0x22, 0x23,
+	};
+	struct sink sink = { .nbytes = 0 };
+	struct pnmwriter *pw;
+	char buf[64], *mem;
+	size_t nbytes;
+	uint64_t size;
+	FILE *f;
+
+	// Memory output is allocated at the exact size, and only handed over
+	// when the image is finished:
+	if ((pw = writer_mem(FORMAT_PGM_BIN, 4, 3, 255)) == NULL) {
+		printf("Fail: test27: could not create memory writer\n");
+		ret = 1;
+		return;
+	}
+	if (pnmwriter_get_size(pw, &size) == false || size != sizeof(expect) - 1) {
+		printf("Fail: test27: memory: wrong output size\n");
+		ret = 1;
+	}
+	pnmwriter_rows(pw, samples, 4, 2);
+	if (pnmwriter_take_mem(pw, &nbytes) != NULL) {
+		printf("Fail: test27: memory: output taken before the image was finished\n");
+		ret = 1;
+	}
+	pnmwriter_row(pw, samples + 8);
+	if ((mem = pnmwriter_take_mem(pw, &nbytes)) == NULL || nbytes != sizeof(expect) - 1 || memcmp(mem, expect, nbytes) != 0) {
+		printf("Fail: test27: memory: wrong output\n");
+		ret = 1;
+	}
+	if (pnmwriter_take_mem(pw, &nbytes) != NULL) {
+		printf("Fail: test27: memory: output taken twice\n");
+		ret = 1;
+	}
+	free(mem);
+	pnmwriter_destroy(pw);
+
+	// File descriptor output:
+	if ((f = tmpfile()) == NULL || (pw = pnmwriter_create_fd(fileno(f))) == NULL) {
+		printf("Fail: test27: could not create file descriptor writer\n");
+		ret = 1;
+		return;
+	}
+	pnmwriter_format(pw, FORMAT_PGM_BIN);
+	pnmwriter_width(pw, 4);
+	pnmwriter_height(pw, 3);
+	pnmwriter_maxval(pw, 255);
+	pnmwriter_rows(pw, samples, 4, 3);
+	pnmwriter_destroy(pw);
+	rewind(f);
+	if (fread(buf, 1, sizeof(buf), f) != sizeof(expect) - 1 || memcmp(buf, expect, sizeof(expect) - 1) != 0) {
+		printf("Fail: test27: file descriptor: wrong output\n");
+		ret = 1;
+	}
+	fclose(f);
+
+	// Callback output:
+	if ((pw = pnmwriter_create_callback(sink_output, &sink)) == NULL) {
+		printf("Fail: test27: could not create callback writer\n");
+		ret = 1;
+		return;
+	}
+	pnmwriter_format(pw, FORMAT_PGM_BIN);
+	pnmwriter_width(pw, 4);
+	pnmwriter_height(pw, 3);
+	pnmwriter_maxval(pw, 255);
+	pnmwriter_rows(pw, samples, 4, 3);
+	if (pnmwriter_flush(pw) == false || sink.nbytes != sizeof(expect) - 1 || memcmp(sink.data, expect, sink.nbytes) != 0) {
+		printf("Fail: test27: callback: wrong output\n");
+		ret = 1;
+	}
+	pnmwriter_destroy(pw);
+
+	// A failing callback makes the error sticky. With a small buffer, the
+	// header is written out as the rows come in:
+	sink = (struct sink) { .fail = true };
+	if ((pw = pnmwriter_create_callback(sink_output, &sink)) == NULL) {
+		printf("Fail: test27: could not create callback writer\n");
+		ret = 1;
+		return;
+	}
+	pnmwriter_bufsize(pw, 4);
+	pnmwriter_format(pw, FORMAT_PGM_BIN);
+	pnmwriter_width(pw, 4);
+	pnmwriter_height(pw, 3);
+	pnmwriter_maxval(pw, 255);
+	if (pnmwriter_rows(pw, samples, 4, 3) == true) {
+		printf("Fail: test27: failing callback: rows accepted\n");
+		ret = 1;
+	}
+	if (pnmwriter_row(pw, samples) == true || pnmwriter_flush(pw) == true || pnmwriter_flush(pw) == true) {
+		printf("Fail: test27: failing callback: error not sticky\n");
+		ret = 1;
+	}
+	if (sink.ncalls != 1) {
+		printf("Fail: test27: failing callback: called %u times, expected once\n", sink.ncalls);
+		ret = 1;
+	}
+	pnmwriter_destroy(pw);
+}
+
+static void
+test28 (void)
+{
+	// Rows with a sample out of range are refused, and the rows before it
+	// are written. The widths cover the vector loops of the range check
+	// and the scalar loop after them, with the bad sample in either:
+	static const unsigned int widths[] = { 16, 37 };
+	static const unsigned int maxvals[] = { 200, 1000 };
+	static const int bad[] = { -1, 0, 15, 17, 31, 36 };
+	uint32_t seed = 1;
+
+	for (size_t m = 0; m < sizeof(maxvals) / sizeof(maxvals[0]); m++)
+	for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+	for (size_t b = 0; b < sizeof(bad) / sizeof(bad[0]); b++) {
+		const unsigned int width = widths[w], maxval = maxvals[m];
+		const size_t samplesize = (maxval > 255) ? 2 : 1;
+		const size_t stride = width * samplesize;
+		struct sink sink = { .nbytes = 0 };
+		struct pnmwriter *pw;
+		uint16_t samples[3 * 37];
+		char expect[512];
+		size_t len;
+
+		if (bad[b] >= (int)width) {
+			continue;
+		}
+		// Three rows, the second one with the bad sample, if any:
+		for (size_t i = 0; i < 3 * width; i++) {
+			const unsigned int v = (i % width == 1) ? maxval : random_sample(&seed, maxval);
+
+			if (samplesize == 1) {
+				((uint8_t *)samples)[i] = v;
+			}
+			else {
+				samples[i] = v;
+			}
+		}
+		if (bad[b] >= 0) {
+			const size_t i = width + bad[b];
+
+			if (samplesize == 1) {
+				((uint8_t *)samples)[i] = (i % 2) ? maxval + 1 : 0xFF;
+			}
+			else {
+				samples[i] = (i % 2) ? maxval + 1 : 0xFFFF;
+			}
+		}
+		if ((pw = pnmwriter_create_callback(sink_output, &sink)) == NULL) {
+			printf("Fail: test28: could not create callback writer\n");
+			ret = 1;
+			return;
+		}
+		pnmwriter_format(pw, FORMAT_PGM_BIN);
+		pnmwriter_width(pw, width);
+		pnmwriter_height(pw, 3);
+		pnmwriter_maxval(pw, maxval);
+
+		if (pnmwriter_rows(pw, samples, stride, 3) != (bad[b] < 0)) {
+			printf("Fail: test28: maxval %u, width %u, bad sample %d: rows: wrong result\n", maxval, width, bad[b]);
+			ret = 1;
+		}
+		if (bad[b] >= 0 && pnmwriter_row(pw, (const char *)samples + stride) == true) {
+			printf("Fail: test28: maxval %u, width %u, bad sample %d: row accepted\n", maxval, width, bad[b]);
+			ret = 1;
+		}
+		pnmwriter_flush(pw);
+		pnmwriter_destroy(pw);
+
+		// The output holds all rows, or only the one before the bad one:
+		len = snprintf(expect, sizeof(expect), "P5\n%u 3\n%u\n", width, maxval);
+		for (size_t i = 0; i < ((bad[b] < 0) ? 3 : 1) * width; i++) {
+			if (samplesize == 1) {
+				expect[len++] = ((uint8_t *)samples)[i];
+			}
+			else {
+				expect[len++] = samples[i] >> 8;
+				expect[len++] = samples[i] & 0xFF;
+			}
+		}
+		if (sink.nbytes != len || memcmp(sink.data, expect, len) != 0) {
+			printf("Fail: test28: maxval %u, width %u, bad sample %d: wrong output\n", maxval, width, bad[b]);
+			ret = 1;
+		}
+	}
+}
+
+static void
+test29 (void)
+{
+	// Golden output of the plain sample formatter, for every number of
+	// digits and every digit pair, for line breaks after each row and at
+	// the line length, and for a line that is exactly full. Written by
+	// pixel and by row:
+	static const unsigned int pgm1[] = {
+		0, 9, 10, 99,
+		100, 999, 1000, 9999,
+		10000, 65535, 12345, 505,
+	};
+	static const unsigned int pgm2[] = {
+		7, 65535, 10000, 42, 999, 1, 12345, 65535, 65535, 80,
+		100, 3, 54321, 9, 99, 1000, 20000, 60000, 8, 65534,
+	};
+	static const unsigned int pgm3[] = {
+		100, 65535, 65535, 65535, 65535, 65535, 65535,
+		65535, 65535, 65535, 65535, 65535, 1, 65535,
+	};
+	static unsigned int pairs[100];
+	static const unsigned int ppm[] = {
+		0, 1, 2, 9, 10, 11, 98, 99, 100,
+		101, 199, 200, 201, 254, 255, 5, 50, 250,
+	};
+	static const struct {
+		enum pnm_format format;
+		unsigned int width;
+		unsigned int height;
+		unsigned int maxval;
+		const unsigned int *samples;
+		const char *expect;
+	} tests[] = {
+		{ FORMAT_PGM_ASC, 4, 3, 65535, pgm1,
+			"P2\n4 3\n65535\n"
+			"0 9 10 99\n"
+			"100 999 1000 9999\n"
+			"10000 65535 12345 505\n" },
+		{ FORMAT_PGM_ASC, 20, 1, 65535, pgm2,
+			"P2\n20 1\n65535\n"
+			"7 65535 10000 42 999 1 12345 65535 65535 80 100 3 54321 9 99 1000\n"
+			"20000 60000 8 65534\n" },
+		{ FORMAT_PGM_ASC, 14, 1, 65535, pgm3,
+			"P2\n14 1\n65535\n"
+			"100 65535 65535 65535 65535 65535 65535 65535 65535 65535 65535 65535\n"
+			"1 65535\n" },
+		{ FORMAT_PPM_ASC, 3, 2, 255, ppm,
+			"P3\n3 2\n255\n"
+			"0 1 2 9 10 11 98\n 99\n 100\n"
+			"101 199 200 201 254 255 5\n 50\n 250\n" },
+		{ FORMAT_PGM_ASC, 10, 10, 9999, pairs,
+			"P2\n10 10\n9999\n"
+			"0 101 202 303 404 505 606 707 808 909\n"
+			"1010 1111 1212 1313 1414 1515 1616 1717 1818 1919\n"
+			"2020 2121 2222 2323 2424 2525 2626 2727 2828 2929\n"
+			"3030 3131 3232 3333 3434 3535 3636 3737 3838 3939\n"
+			"4040 4141 4242 4343 4444 4545 4646 4747 4848 4949\n"
+			"5050 5151 5252 5353 5454 5555 5656 5757 5858 5959\n"
+			"6060 6161 6262 6363 6464 6565 6666 6767 6868 6969\n"
+			"7070 7171 7272 7373 7474 7575 7676 7777 7878 7979\n"
+			"8080 8181 8282 8383 8484 8585 8686 8787 8888 8989\n"
+			"9090 9191 9292 9393 9494 9595 9696 9797 9898 9999\n" },
+	};
+
+	for (unsigned int i = 0; i < 100; i++) {
+		pairs[i] = i * 101;
+	}
+
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		const unsigned int depth = (tests[t].format == FORMAT_PPM_ASC) ? 3 : 1;
+		const size_t n = (size_t)tests[t].width * tests[t].height * depth;
+		const size_t stride = (size_t)tests[t].width * depth * ((tests[t].maxval > 255) ? 2 : 1);
+		uint16_t samples[100];
+
+		for (size_t i = 0; i < n; i++) {
+			if (tests[t].maxval > 255) {
+				samples[i] = tests[t].samples[i];
+			}
+			else {
+				((uint8_t *)samples)[i] = tests[t].samples[i];
+			}
+		}
+		for (int byrow = 0; byrow < 2; byrow++) {
+			struct pnmwriter *pw;
+			char *out = NULL;
+			size_t nbytes;
+
+			if ((pw = writer_mem(tests[t].format, tests[t].width, tests[t].height, tests[t].maxval)) == NULL) {
+				printf("Fail: test29: could not create memory writer\n");
+				ret = 1;
+				return;
+			}
+			if (byrow) {
+				pnmwriter_rows(pw, samples, stride, tests[t].height);
+			}
+			else for (size_t i = 0; i < n; i += depth) {
+				const unsigned int *p = tests[t].samples + i;
+
+				pnmwriter_pixel(pw, p[0], p[depth / 2], p[depth - 1]);
+			}
+			if ((out = pnmwriter_take_mem(pw, &nbytes)) == NULL
+			 || nbytes != strlen(tests[t].expect)
+			 || memcmp(out, tests[t].expect, nbytes) != 0) {
+				printf("Fail: test29: image %zu: wrong output by %s\n", t, byrow ? "row" : "pixel");
+				ret = 1;
+			}
+			free(out);
+			pnmwriter_destroy(pw);
+		}
+	}
+}
+
+struct pbmroi
+{
+	const unsigned int *pixels;
+	unsigned int width;
+	unsigned int x;
+	unsigned int y;
+	unsigned int roiwidth;
+	unsigned int nrows;
+	bool fail;
+};
+
+static bool
+pbmroi_got_row (unsigned int row, const void *samples, void *data)
+{
+	// Compare the row of the region with the image:
+	struct pbmroi *roi = data;
+	const uint8_t *p = samples;
+
+	for (unsigned int i = 0; i < roi->roiwidth; i++) {
+		if (p[i] != roi->pixels[row * roi->width + roi->x + i]) {
+			roi->fail = true;
+		}
+	}
+	if (row != roi->y + roi->nrows++) {
+		roi->fail = true;
+	}
+	return true;
+}
+
+static void
+test30 (void)
+{
+	// Binary PBM of widths around a byte, with garbage in the padding
+	// bits, fed whole and in chunks that end runs halfway a row, by pixel
+	// and by row. Then a region of interest inside the image:
+	static const unsigned int widths[] = { 1, 7, 9, 17 };
+	static const size_t feedsizes[] = { 0, 1, 2, 5 };
+	const unsigned int height = 3;
+	uint32_t seed = 1;
+
+	for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+		const unsigned int width = widths[w];
+		const size_t rowsize = (width + 7) / 8;
+		unsigned int pixels[17 * 3];
+		char image[32 + 3 * 3];
+		char name[32];
+		size_t len;
+
+		len = snprintf(image, sizeof(image), "P4\n%u %u\n", width, height);
+		for (unsigned int row = 0; row < height; row++) {
+			for (size_t i = 0; i < rowsize; i++) {
+				unsigned char byte = random_sample(&seed, 255);
+
+				// Set the padding bits:
+				if (i == rowsize - 1 && width % 8 != 0) {
+					byte |= 0xFF >> (width % 8);
+				}
+				image[len + row * rowsize + i] = byte;
+			}
+			for (unsigned int col = 0; col < width; col++) {
+				pixels[row * width + col] = (unsigned char)image[len + row * rowsize + col / 8] >> (7 - col % 8) & 1;
+			}
+		}
+		len += height * rowsize;
+
+		for (size_t f = 0; f < sizeof(feedsizes) / sizeof(feedsizes[0]); f++)
+		for (int rows = 0; rows < 2; rows++) {
+			snprintf(name, sizeof(name), "test30: width %u, feed %zu", width, feedsizes[f]);
+			run_test(&(struct test) {
+				.image = image,
+				.nbytes = len,
+				.name = name,
+				.width = width,
+				.height = height,
+				.format = FORMAT_PBM_BIN,
+				.maxval = 1,
+				.pixels = pixels,
+				.result = PNMREADER_FINISHED,
+				.rows = rows,
+				.feedsize = feedsizes[f],
+			});
+		}
+		if (width < 9) {
+			continue;
+		}
+		// A region that starts and ends halfway a byte:
+		for (size_t f = 0; f < sizeof(feedsizes) / sizeof(feedsizes[0]); f++) {
+			const size_t feedsize = (feedsizes[f] > 0) ? feedsizes[f] : len;
+			struct pbmroi roi = { pixels, width, 3, 1, width - 5, 0, false };
+			struct pnmreader *pr;
+			enum pnmreader_result res = PNMREADER_FEED_ME;
+
+			if ((pr = pnmreader_create_rows(NULL, NULL, NULL, pbmroi_got_row, &roi)) == NULL) {
+				printf("Fail: test30: pnmreader_create: could not allocate pnmreader\n");
+				ret = 1;
+				return;
+			}
+			pnmreader_set_roi(pr, roi.x, roi.y, roi.roiwidth, 2);
+
+			for (size_t pos = 0; pos < len && res == PNMREADER_FEED_ME; pos += feedsize) {
+				res = pnmreader_feed(pr, image + pos, (len - pos < feedsize) ? len - pos : feedsize);
+			}
+			if (res != PNMREADER_FINISHED || roi.fail || roi.nrows != 2) {
+				printf("Fail: test30: width %u, feed %zu: wrong region, got %u rows\n", width, feedsizes[f], roi.nrows);
+				ret = 1;
+			}
+			pnmreader_destroy(pr);
+		}
+	}
+}
+
+static void
+test31 (void)
+{
+	// Two-byte binary PGM and PPM with rows long enough for the vector
+	// loops of the range check and the byte swap. Decode them whole and
+	// byte by byte, then put an out-of-range sample in the vector loops
+	// or in the scalar loop after them and check where decoding stops:
+	static const struct {
+		enum pnm_format format;
+		unsigned int width;
+		unsigned int bad[3];
+	} tests[] = {
+		{ FORMAT_PGM_BIN, 37, { 9, 20, 35 } },
+		{ FORMAT_PPM_BIN, 13, { 9, 20, 37 } },
+	};
+	const unsigned int height = 2, maxval = 1000;
+	uint32_t seed = 1;
+
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		const unsigned int channels = (tests[t].format == FORMAT_PPM_BIN) ? 3 : 1;
+		const unsigned int rowlen = tests[t].width * channels;
+		unsigned int pixels[37 * 2];
+		uint16_t samples[39 * 2];
+		char image[32 + 39 * 2 * 2];
+		size_t hdrlen, len;
+		char name[32];
+
+		hdrlen = snprintf(image, sizeof(image), "P%d\n%u %u\n%u\n", (tests[t].format == FORMAT_PPM_BIN) ? 6 : 5, tests[t].width, height, maxval);
+		len = hdrlen + height * rowlen * 2;
+		for (unsigned int i = 0; i < height * rowlen; i++) {
+			samples[i] = (i % 7 == 0) ? maxval : random_sample(&seed, maxval);
+			image[hdrlen + i * 2] = samples[i] >> 8;
+			image[hdrlen + i * 2 + 1] = samples[i] & 0xFF;
+		}
+		for (unsigned int i = 0; i < height * tests[t].width; i++) {
+			pixels[i] = samples[i * channels];
+		}
+		for (int rows = 0; rows < 2; rows++)
+		for (size_t feedsize = 0; feedsize < 2; feedsize++) {
+			snprintf(name, sizeof(name), "test31: image %zu", t);
+			run_test(&(struct test) {
+				.image = image,
+				.nbytes = len,
+				.name = name,
+				.width = tests[t].width,
+				.height = height,
+				.format = tests[t].format,
+				.maxval = maxval,
+				.pixels = pixels,
+				.result = PNMREADER_FINISHED,
+				.rows = rows,
+				.feedsize = feedsize,
+			});
+		}
+		for (size_t b = 0; b < sizeof(tests[t].bad) / sizeof(tests[t].bad[0]); b++) {
+			// The bad sample is in the second row. Decoding stops on the
+			// last byte of its pixel:
+			const size_t offset = hdrlen + (rowlen + tests[t].bad[b]) * 2;
+			const size_t end = hdrlen + (rowlen + tests[t].bad[b] / channels * channels + channels) * 2 - 1;
+			char bad[sizeof(image)];
+
+			memcpy(bad, image, len);
+			bad[offset] = (char)0x03;
+			bad[offset + 1] = (char)0xE9;
+
+			for (size_t feedsize = len; feedsize > 0; feedsize = (feedsize == 1) ? 0 : 1) {
+				struct pnmreader *pr;
+				enum pnmreader_result res = PNMREADER_FEED_ME;
+				size_t pos = 0;
+
+				if ((pr = pnmreader_create_rows(NULL, NULL, NULL, NULL, NULL)) == NULL) {
+					printf("Fail: test31: pnmreader_create: could not allocate pnmreader\n");
+					ret = 1;
+					return;
+				}
+				for (; pos < len && res == PNMREADER_FEED_ME; pos += feedsize) {
+					res = pnmreader_feed(pr, bad + pos, (len - pos < feedsize) ? len - pos : feedsize);
+				}
+				pos = pos - feedsize + pnmreader_get_consumed(pr);
+				if (res != PNMREADER_INVALID_CHAR || pos != end) {
+					printf("Fail: test31: image %zu, sample %u, feed %zu: got %d at offset %zu, expected %d at %zu\n",
+						t, tests[t].bad[b], feedsize, res, pos, PNMREADER_INVALID_CHAR, end);
+					ret = 1;
+				}
+				pnmreader_destroy(pr);
+			}
+		}
+	}
+}
+
+static void
+test32 (void)
+{
+	// Map binary images at an offset into a file, after some other data,
+	// and check the raster pointer and stride. Truncated files need more
+	// data, and plain images can not be mapped:
+	static const struct {
+		const char *image;
+		size_t nbytes;
+		enum pnmreader_result result;
+		enum pnm_format format;
+		unsigned int width;
+		unsigned int height;
+		unsigned int maxval;
+		size_t hdrlen;
+		size_t stride;
+	} tests[] = {
+		{ "P4\n10 2\n\xFF\xC0\x80\x40", 12, PNMREADER_SUCCESS, FORMAT_PBM_BIN, 10, 2, 1, 8, 2 },
+		{ "P5 3 1 1000\n\x03\xE8\x00\x01\x00\x02", 18, PNMREADER_SUCCESS, FORMAT_PGM_BIN, 3, 1, 1000, 12, 6 },
+		{ "P6 2 2 255\n" "ABCDEF" "abcdef", 23, PNMREADER_SUCCESS, FORMAT_PPM_BIN, 2, 2, 255, 11, 6 },
+		{ "P6 2 2 255\n" "ABCDEF" "abcde", 22, PNMREADER_FEED_ME },
+		{ "P5 2 2 255\n", 11, PNMREADER_FEED_ME },
+		{ "P2 2 1 255\n1 2\n", 15, PNMREADER_UNSUPPORTED },
+		{ "P3 1 1 255\n1 2 3\n", 17, PNMREADER_UNSUPPORTED },
+	};
+	char path[] = "/tmp/test-reader-XXXXXX";
+	char skip[5000];
+	int fd;
+
+	memset(skip, '#', sizeof(skip));
+	if ((fd = mkstemp(path)) < 0) {
+		printf("Fail: test32: could not create temporary file\n");
+		ret = 1;
+		return;
+	}
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++)
+	for (int byname = 0; byname < 2; byname++) {
+		// The file is opened by name at the start, or mapped from
+		// after the other data:
+		const size_t offset = byname ? 0 : sizeof(skip);
+		struct pnmreader_map map;
+		enum pnmreader_result res;
+
+		if (ftruncate(fd, 0) != 0
+		 || lseek(fd, 0, SEEK_SET) != 0
+		 || write(fd, skip, offset) != (ssize_t)offset
+		 || write(fd, tests[t].image, tests[t].nbytes) != (ssize_t)tests[t].nbytes
+		 || lseek(fd, offset, SEEK_SET) != (off_t)offset) {
+			printf("Fail: test32: could not write temporary file\n");
+			ret = 1;
+			break;
+		}
+		res = byname ? pnmreader_map_file(path, &map) : pnmreader_map_fd(fd, &map);
+		if (res != tests[t].result) {
+			printf("Fail: test32: image %zu: expected %d, got %d\n", t, tests[t].result, res);
+			ret = 1;
+		}
+		if (res != PNMREADER_SUCCESS) {
+			continue;
+		}
+		if (map.format != tests[t].format
+		 || map.width != tests[t].width
+		 || map.height != tests[t].height
+		 || map.maxval != tests[t].maxval
+		 || map.size != tests[t].nbytes
+		 || memcmp(map.data, tests[t].image, tests[t].nbytes) != 0) {
+			printf("Fail: test32: image %zu: wrong header or data\n", t);
+			ret = 1;
+		}
+		if (map.raster != (const unsigned char *)map.data + tests[t].hdrlen || map.stride != tests[t].stride) {
+			printf("Fail: test32: image %zu: wrong raster or stride\n", t);
+			ret = 1;
+		}
+		pnmreader_unmap(&map);
+	}
+	close(fd);
+	unlink(path);
+}
+
+static void
+test33 (void)
+{
+	// Binary PBM of every width from UINT_MAX - 7 to the largest one, so
+	// that the row size in bytes does not fit in an unsigned int before
+	// it is divided. The pixels of a partial first row are passed on,
+	// fed whole and byte by byte:
+	for (unsigned int width = UINT_MAX - 7; width < UINT_MAX; width++)
+	for (size_t feedsize = 0; feedsize < 2; feedsize++) {
+		char image[32 + 64];
+		struct stream s = { 0, 0 };
+		struct pnmreader *pr;
+		enum pnmreader_result res = PNMREADER_FEED_ME;
+		size_t len, step, pos = 0;
+
+		len = snprintf(image, sizeof(image), "P4\n%u 2\n", width);
+		memset(image + len, 0xFF, 64);
+		len += 64;
+		step = (feedsize > 0) ? feedsize : len;
+
+		if ((pr = pnmreader_create(NULL, NULL, NULL, stream_got_pixel, &s)) == NULL) {
+			printf("Fail: test33: pnmreader_create: could not allocate pnmreader\n");
+			ret = 1;
+			return;
+		}
+		for (; pos < len && res == PNMREADER_FEED_ME; pos += step) {
+			res = pnmreader_feed(pr, image + pos, step);
+		}
+		if (res != PNMREADER_FEED_ME || pnmreader_get_consumed(pr) != step) {
+			printf("Fail: test33: width %u, feed %zu: expected %d, got %d\n", width, feedsize, PNMREADER_FEED_ME, res);
+			ret = 1;
+		}
+		if (s.sum != 3 * 64 * 8) {
+			printf("Fail: test33: width %u, feed %zu: expected %u pixels, got sum %u\n", width, feedsize, 64 * 8, s.sum);
+			ret = 1;
+		}
+		pnmreader_destroy(pr);
+	}
+}
+
 int
 main (void)
 {
@@ -217,6 +2194,33 @@ main (void)
 	test4();
 	test5();
 	test6();
+	test7();
+	test8();
+	test9();
+	test10();
+	test11();
+	test12();
+	test13();
+	test14();
+	test15();
+	test16();
+	test17();
+	test18();
+	test19();
+	test20();
+	test21();
+	test22();
+	test23();
+	test24();
+	test25();
+	test26();
+	test27();
+	test28();
+	test29();
+	test30();
+	test31();
+	test32();
+	test33();
 
 	return ret;
 }
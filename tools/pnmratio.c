@@ -1,10 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "../pnmreader/pnmreader.h"
 #include "../pnmwriter/pnmwriter.h"
+#include "../pnmio/pnmio.h"
 
 enum xaffinity { XLEFT, XCENTER, XRIGHT };
 enum yaffinity { YTOP, YMIDDLE, YBOTTOM };
@@ -49,20 +53,21 @@ get_size (unsigned int width, unsigned int height, struct job *job)
 	// ratio, and return it in job->out_wd and job->out_ht. Return true if
 	// the ratio is attainable, false if it's impossible for the image
 	// (say, 1000:1 on a 10x10 square).
-	int height_divisions = height / job->yratio;
-	int width_divisions = width / job->xratio;
+	unsigned int height_divisions = height / job->yratio;
+	unsigned int width_divisions = width / job->xratio;
 	bool use_width = (height_divisions > width_divisions) ? 1 : 0;
-	int divisions = (use_width) ? width_divisions : height_divisions;
-	int i;
+	unsigned int divisions = (use_width) ? width_divisions : height_divisions;
+	unsigned int i;
 
 	// Choose the side that will result in the least number of divisions.
 	// For each division, calculate the corresponding width/height, and
-	// if it fits into the image, use that:
-	for (i = divisions; i >= 0; i--) {
-		if (use_width && job->yratio * divisions <= height) {
+	// if it fits into the image, use that. Images can be wider or higher
+	// than an int, so count in unsigned ints:
+	for (i = divisions; i > 0; i--) {
+		if (use_width && (uint64_t)job->yratio * i <= height) {
 			break;
 		}
-		if (!use_width && job->xratio * divisions <= width) {
+		if (!use_width && (uint64_t)job->xratio * i <= width) {
 			break;
 		}
 	}
@@ -89,6 +94,8 @@ static bool
 got_geometry (unsigned int width, unsigned int height, void *userdata)
 {
 	struct job *job = userdata;
+	const char *tupltype;
+	unsigned int depth;
 
 	if (get_size(width, height, job) == false) {
 		return false;
@@ -103,7 +110,16 @@ got_geometry (unsigned int width, unsigned int height, void *userdata)
 		: (job->yaffinity == YMIDDLE) ? (height - job->out_ht) / 2
 		: height - job->out_ht;
 
-	return pnmwriter_width(job->pw, job->out_wd)
+	// Pass on the depth and tuple type of PAM images:
+	if (pnmreader_get_depth(job->pr, &depth) == false || pnmwriter_depth(job->pw, depth) == false) {
+		return false;
+	}
+	if (pnmreader_get_tupltype(job->pr, &tupltype) && pnmwriter_tupltype(job->pw, tupltype) == false) {
+		return false;
+	}
+	// Let the reader drop the pixels outside the cropped area:
+	return pnmreader_set_roi(job->pr, job->colstart, job->rowstart, job->out_wd, job->out_ht)
+	    && pnmwriter_width(job->pw, job->out_wd)
 	    && pnmwriter_height(job->pw, job->out_ht);
 }
 
@@ -114,17 +130,11 @@ got_maxval (unsigned int maxval, void *userdata)
 }
 
 static bool
-got_pixel (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata)
+got_row (unsigned int row, const void *samples, void *userdata)
 {
-	struct job *job = userdata;
-
-	if (col < job->colstart || col >= job->colstart + job->out_wd) {
-		return true;
-	}
-	if (row < job->rowstart || row >= job->rowstart + job->out_ht) {
-		return true;
-	}
-	return pnmwriter_pixel(job->pw, r, g, b);
+	// The reader has range-checked the samples, and its rows have the
+	// layout that the writer takes:
+	return pnmwriter_rows_unchecked(((struct job *)userdata)->pw, samples, 0, 1);
 }
 
 static void
@@ -231,18 +241,13 @@ main (int argc, char **argv)
 {
 	int d;
 	int ret = 1;
-	char *buf;
-	size_t nread;
-	size_t bufsize = 1024 * 1024;
 	struct job job = { .ratio_possible = true };
+	enum pnmreader_result res;
 
 	if (parse_args(argc, argv, &job) == false) {
 		usage();
 		goto out0;
 	}
-	if ((buf = malloc(bufsize)) == NULL) {
-		goto out0;
-	}
 	// Divide xratio and yratio by their greatest common divisor:
 	if ((d = gcd(job.xratio, job.yratio)) > 1) {
 		job.xratio /= d;
@@ -250,26 +255,25 @@ main (int argc, char **argv)
 	}
 	if ((job.pw = pnmwriter_create(stdout)) == NULL) {
 		fputs("could not create pnmwriter\n", stderr);
-		goto out1;
+		goto out0;
 	}
-	if ((job.pr = pnmreader_create(got_format, got_geometry, got_maxval, got_pixel, &job)) == NULL) {
+	if ((job.pr = pnmreader_create_rows(got_format, got_geometry, got_maxval, got_row, &job)) == NULL) {
 		fputs("could not create pnmreader\n", stderr);
-		goto out2;
+		goto out1;
 	}
-	while ((nread = fread(buf, 1, bufsize, stdin)) > 0) {
-		switch (pnmreader_feed(job.pr, buf, nread)) {
-			case PNMREADER_ABORTED: fputs(job.ratio_possible ? "aborted\n" : "impossible ratio\n", stderr); break;
-			case PNMREADER_INVALID_CHAR: fputs("invalid char\n", stderr); break;
-			case PNMREADER_UNSUPPORTED: fputs("unsupported\n", stderr); break;
-			case PNMREADER_NO_SIGNATURE: fputs("not a PNM file\n", stderr); break;
-			case PNMREADER_FINISHED: ret = 0; break;
-			case PNMREADER_FEED_ME: continue;
-			default: fputs("Unknown error\n", stderr); break;
-		}
-		break;
+	// Decode the input as it is read:
+	res = pnmio_feed_fd(job.pr, fileno(stdin));
+
+	switch (res) {
+		case PNMREADER_ABORTED: fputs(job.ratio_possible ? "aborted\n" : "impossible ratio\n", stderr); break;
+		case PNMREADER_INVALID_CHAR: fputs("invalid char\n", stderr); break;
+		case PNMREADER_UNSUPPORTED: fputs("unsupported\n", stderr); break;
+		case PNMREADER_NO_SIGNATURE: fputs("not a PNM file\n", stderr); break;
+		case PNMREADER_FINISHED: ret = 0; break;
+		case PNMREADER_FEED_ME: break;
+		default: fputs("Unknown error\n", stderr); break;
 	}
 	pnmreader_destroy(job.pr);
-out2:	pnmwriter_destroy(job.pw);
-out1:	free(buf);
+out1:	pnmwriter_destroy(job.pw);
 out0:	return ret;
 }
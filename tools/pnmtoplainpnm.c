@@ -1,75 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
-#include <stdlib.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../pnmreader/pnmreader.h"
 #include "../pnmwriter/pnmwriter.h"
+#include "../pnmio/pnmio.h"
+
+// Rows are collected in batches of about this many bytes, which are
+// formatted on all processors:
+#define BATCH_SIZE	(8 * 1024 * 1024)
+
+struct job {
+	struct pnmreader *pr;
+	struct pnmwriter *pw;
+	unsigned int width;
+	unsigned int height;
+	unsigned int nthreads;
+
+	// The batch of rows:
+	char *rows;
+	size_t rowsize;
+	unsigned int nrows;
+	unsigned int maxrows;
+};
 
 static bool
 got_format (enum pnm_format format, void *userdata)
 {
+	// PAM has no plain variant:
+	if (format == FORMAT_PAM) {
+		return false;
+	}
 	// Convert from binary to plain formats:
 	if (format == FORMAT_PBM_BIN) format = FORMAT_PBM_ASC;
 	if (format == FORMAT_PGM_BIN) format = FORMAT_PGM_ASC;
 	if (format == FORMAT_PPM_BIN) format = FORMAT_PPM_ASC;
 
-	return pnmwriter_format(userdata, format);
+	return pnmwriter_format(((struct job *)userdata)->pw, format);
 }
 
 static bool
 got_geometry (unsigned int width, unsigned int height, void *userdata)
 {
-	return pnmwriter_width(userdata, width)
-	    && pnmwriter_height(userdata, height);
+	struct job *job = userdata;
+
+	job->width = width;
+	job->height = height;
+	return pnmwriter_width(job->pw, width)
+	    && pnmwriter_height(job->pw, height);
 }
 
 static bool
 got_maxval (unsigned int maxval, void *userdata)
 {
-	return pnmwriter_maxval(userdata, maxval);
+	struct job *job = userdata;
+	unsigned int depth;
+
+	if (pnmreader_get_depth(job->pr, &depth) == false) {
+		return false;
+	}
+	// A single processor formats the rows as they come:
+	if (job->nthreads == 1) {
+		return pnmwriter_maxval(job->pw, maxval);
+	}
+	// Size the batch to hold at least one row:
+	job->rowsize = (size_t)job->width * depth * ((maxval < 256) ? 1 : 2);
+	job->maxrows = (job->rowsize < BATCH_SIZE) ? BATCH_SIZE / job->rowsize : 1;
+	if (job->maxrows > job->height) {
+		job->maxrows = job->height;
+	}
+	if ((job->rows = malloc(job->rowsize * job->maxrows)) == NULL) {
+		return false;
+	}
+	return pnmwriter_maxval(job->pw, maxval);
+}
+
+static bool
+write_batch (struct job *job)
+{
+	unsigned int nrows = job->nrows;
+
+	job->nrows = 0;
+	return pnmwriter_rows_parallel(job->pw, job->rows, job->rowsize, nrows, job->nthreads);
 }
 
 static bool
-got_pixel (unsigned int col, unsigned int row, unsigned int r, unsigned int g, unsigned int b, void *userdata)
+got_row (unsigned int row, const void *samples, void *userdata)
 {
-	return pnmwriter_pixel(userdata, r, g, b);
+	struct job *job = userdata;
+
+	// The reader has range-checked the samples:
+	if (job->rows == NULL) {
+		return pnmwriter_rows_unchecked(job->pw, samples, 0, 1);
+	}
+	memcpy(job->rows + job->nrows++ * job->rowsize, samples, job->rowsize);
+
+	// Write out a full batch, or the last one:
+	if (job->nrows < job->maxrows && row + 1 < job->height) {
+		return true;
+	}
+	return write_batch(job);
 }
 
 int
 main (int argc, char **argv)
 {
-	size_t nread;
-	size_t bufsize = 1024 * 1024;
-	struct pnmreader *pr;
-	struct pnmwriter *pw;
-	char *buf;
+	struct job job = { .rows = NULL, .nrows = 0 };
+	enum pnmreader_result res;
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
 	int ret = 1;
 
-	if ((buf = malloc(bufsize)) == NULL) {
+	job.nthreads = (nprocs > 1) ? nprocs : 1;
+
+	if ((job.pw = pnmwriter_create(stdout)) == NULL) {
+		fputs("could not create pnmwriter\n", stderr);
 		goto out0;
 	}
-	if ((pw = pnmwriter_create(stdout)) == NULL) {
-		fputs("could not create pnmwriter\n", stderr);
+	if ((job.pr = pnmreader_create_rows(got_format, got_geometry, got_maxval, got_row, &job)) == NULL) {
+		fputs("could not create pnmreader\n", stderr);
 		goto out1;
 	}
-	if ((pr = pnmreader_create(got_format, got_geometry, got_maxval, got_pixel, pw)) == NULL) {
-		fputs("could not create pnmreader\n", stderr);
-		goto out2;
+	// Decode the input as it is read, and write out the rows that
+	// were decoded before an error. The pixels of a partial last row
+	// are not passed on, so truncated input ends at the last whole row:
+	res = pnmio_feed_fd(job.pr, fileno(stdin));
+	if (job.nrows > 0) {
+		write_batch(&job);
 	}
-	while ((nread = fread(buf, 1, bufsize, stdin)) > 0) {
-		switch (pnmreader_feed(pr, buf, nread)) {
-			case PNMREADER_ABORTED: fputs("aborted\n", stderr); break;
-			case PNMREADER_INVALID_CHAR: fputs("invalid char\n", stderr); break;
-			case PNMREADER_UNSUPPORTED: fputs("unsupported\n", stderr); break;
-			case PNMREADER_NO_SIGNATURE: fputs("not a PNM file\n", stderr); break;
-			case PNMREADER_FINISHED: ret = 0; break;
-			case PNMREADER_FEED_ME: continue;
-			default: fputs("Unknown error\n", stderr); break;
-		}
-		break;
+
+	switch (res) {
+		case PNMREADER_ABORTED: fputs("aborted\n", stderr); break;
+		case PNMREADER_INVALID_CHAR: fputs("invalid char\n", stderr); break;
+		case PNMREADER_UNSUPPORTED: fputs("unsupported\n", stderr); break;
+		case PNMREADER_NO_SIGNATURE: fputs("not a PNM file\n", stderr); break;
+		case PNMREADER_FINISHED: ret = 0; break;
+		case PNMREADER_FEED_ME: break;
+		default: fputs("Unknown error\n", stderr); break;
 	}
-	pnmreader_destroy(pr);
-out2:	pnmwriter_destroy(pw);
-out1:	free(buf);
+	pnmreader_destroy(job.pr);
+	free(job.rows);
+out1:	pnmwriter_destroy(job.pw);
 out0:	return ret;
 }